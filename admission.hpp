@@ -0,0 +1,254 @@
+#ifndef ADMISSION_HPP
+#define ADMISSION_HPP
+
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <boost/asio.hpp>
+
+//admission control and bandwidth buckets. shared by socks_server and the
+//admission benchmark of socks_bench.
+
+//asio has no std::hash for addresses and endpoints
+struct address_hash
+{
+    std::size_t operator()(const boost::asio::ip::address &addr) const
+    {
+        if (addr.is_v4())
+            return std::hash<uint32_t>()(addr.to_v4().to_uint());
+        auto bytes = addr.to_v6().to_bytes();
+        uint64_t halves[2];
+        std::memcpy(halves, bytes.data(), sizeof(halves));
+        return std::hash<uint64_t>()(halves[0] ^ halves[1]);
+    }
+    std::size_t operator()(const boost::asio::ip::udp::endpoint &ep) const
+    {
+        return (*this)(ep.address()) ^ (std::size_t(ep.port()) << 16);
+    }
+};
+
+//token bucket in its GCRA form: the whole state is one atomic "theoretical
+//arrival time", so a limiter shared by tunnels on several threads needs no
+//lock. the bucket holds burst worth of time at the configured rate.
+class rate_limiter
+{
+public:
+    typedef std::chrono::nanoseconds duration;
+
+    //rate in units per second, 0 = unlimited
+    void configure(uint64_t rate, duration burst)
+    {
+        rate_ = rate;
+        burst_ = burst.count();
+    }
+    bool enabled() const
+    {
+        return rate_ != 0;
+    }
+    static int64_t now()
+    {
+        return std::chrono::duration_cast<duration>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    //always charges n units, returns how long the caller should hold off
+    duration take(uint64_t n, int64_t now)
+    {
+        int64_t cost = n * 1000000000 / rate_;
+        int64_t tat = tat_.load(std::memory_order_relaxed);
+        int64_t next;
+        do
+            next = std::max(tat, now) + cost;
+        while (!tat_.compare_exchange_weak(tat, next, std::memory_order_relaxed));
+        return duration(std::max<int64_t>(0, next - burst_ - now));
+    }
+    //charges n units only if that needs no waiting
+    bool try_take(uint64_t n, int64_t now)
+    {
+        int64_t cost = n * 1000000000 / rate_;
+        int64_t tat = tat_.load(std::memory_order_relaxed);
+        int64_t next;
+        do
+        {
+            next = std::max(tat, now) + cost;
+            if (next - burst_ > now)
+                return false;
+        } while (!tat_.compare_exchange_weak(tat, next, std::memory_order_relaxed));
+        return true;
+    }
+    //nothing owed any more, the bucket is full
+    bool idle(int64_t now) const
+    {
+        return tat_.load(std::memory_order_relaxed) <= now;
+    }
+
+private:
+    std::atomic<int64_t> tat_{0};
+    uint64_t rate_ = 0;
+    int64_t burst_ = 0;
+};
+
+//admission control at accept time: total tunnels, tunnels per source
+//address and new connections per second per source. clients live in shards
+//picked by address hash, each shard behind its own mutex, so accepts on
+//different loops rarely meet; the total is a lock-free counter. a client's
+//bandwidth buckets are shared lock-free by all of its tunnels.
+class admission
+{
+public:
+    //0 = unlimited
+    struct limits
+    {
+        unsigned max_tunnels = 0;
+        unsigned max_per_client = 0;
+        //new connections per second and client
+        unsigned max_connect_rate = 0;
+        //bytes per second and direction of all tunnels of a client
+        uint64_t client_bandwidth = 0;
+    };
+
+    struct client
+    {
+        //guarded by the shard mutex
+        unsigned active = 0;
+        rate_limiter connects;
+        //upstream and downstream
+        rate_limiter bandwidth[2];
+    };
+
+    //one admitted connection, returns its slots when destroyed
+    class ticket
+    {
+    public:
+        ticket(admission &owner, const boost::asio::ip::address &addr, std::shared_ptr<client> c)
+            : owner_(owner), addr_(addr), client_(std::move(c))
+        {}
+        ticket(const ticket &) = delete;
+        ticket &operator=(const ticket &) = delete;
+        ~ticket()
+        {
+            owner_.release(addr_, client_);
+        }
+        //null unless a per-client limit is configured
+        client *owner() const
+        {
+            return client_.get();
+        }
+
+    private:
+        admission &owner_;
+        boost::asio::ip::address addr_;
+        std::shared_ptr<client> client_;
+    };
+
+    //before the first admit
+    void configure(const limits &l)
+    {
+        limits_ = l;
+    }
+    bool enabled() const
+    {
+        return limits_.max_tunnels || per_client();
+    }
+
+    //null if the connection is refused
+    std::shared_ptr<ticket> admit(const boost::asio::ip::address &addr)
+    {
+        if (limits_.max_tunnels && total_.fetch_add(1, std::memory_order_relaxed) >= limits_.max_tunnels)
+        {
+            total_.fetch_sub(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        std::shared_ptr<client> c;
+        if (per_client())
+        {
+            int64_t now = rate_limiter::now();
+            shard &s = shard_of(addr);
+            std::lock_guard<std::mutex> lock(s.mutex);
+            auto &entry = s.clients[addr];
+            if (!entry)
+            {
+                entry = std::make_shared<client>();
+                entry->connects.configure(limits_.max_connect_rate, std::chrono::seconds(1));
+                for (auto &b : entry->bandwidth)
+                    b.configure(limits_.client_bandwidth, bandwidth_burst);
+            }
+            bool refused = (limits_.max_per_client && entry->active >= limits_.max_per_client) ||
+                           (limits_.max_connect_rate && !entry->connects.try_take(1, now));
+            if (refused)
+            {
+                if (limits_.max_tunnels)
+                    total_.fetch_sub(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+            entry->active++;
+            c = entry;
+            //forget clients that are gone and owe nothing, once in a while
+            if (++s.admitted % sweep_every == 0)
+                sweep(s, now);
+        }
+        return std::make_shared<ticket>(*this, addr, std::move(c));
+    }
+
+    //bursts of a shaped tunnel or client: 100 ms at the configured rate
+    static constexpr std::chrono::milliseconds bandwidth_burst{100};
+
+private:
+    enum
+    {
+        shard_count = 64,
+        sweep_every = 1024
+    };
+    struct shard
+    {
+        std::mutex mutex;
+        std::unordered_map<boost::asio::ip::address, std::shared_ptr<client>, address_hash> clients;
+        uint64_t admitted = 0;
+        //keep neighbouring shards' mutexes off one cache line
+        char pad_[64];
+    };
+    limits limits_;
+    shard shards_[shard_count];
+    std::atomic<unsigned> total_{0};
+
+    bool per_client() const
+    {
+        return limits_.max_per_client || limits_.max_connect_rate || limits_.client_bandwidth;
+    }
+    shard &shard_of(const boost::asio::ip::address &addr)
+    {
+        return shards_[address_hash()(addr) % shard_count];
+    }
+
+    void release(const boost::asio::ip::address &addr, const std::shared_ptr<client> &c)
+    {
+        if (limits_.max_tunnels)
+            total_.fetch_sub(1, std::memory_order_relaxed);
+        if (!c)
+            return;
+        shard &s = shard_of(addr);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        c->active--;
+    }
+
+    static bool forgettable(const client &c, int64_t now)
+    {
+        return c.active == 0 && c.connects.idle(now) && c.bandwidth[0].idle(now) && c.bandwidth[1].idle(now);
+    }
+    void sweep(shard &s, int64_t now)
+    {
+        for (auto it = s.clients.begin(); it != s.clients.end();)
+            if (forgettable(*it->second, now))
+                it = s.clients.erase(it);
+            else
+                ++it;
+    }
+};
+constexpr std::chrono::milliseconds admission::bandwidth_burst;
+
+#endif
@@ -0,0 +1,81 @@
+#!/bin/sh
+#a CONNECT that never completes must not leak its session: once the connect
+#times out, or the client hangs up while it is pending, the server's
+#socks_live_connections gauge must be back to 0 and the --max-tunnels slot
+#must be free again. the destination is a local listener whose backlog is
+#full, so the kernel drops the SYNs and connects to it just hang.
+#
+#usage: ./connect_timeout_check.sh [ROUNDS]
+
+rounds=${1:-3}
+port=${PORT:-1097}
+metrics=${METRICS_PORT:-9197}
+status=0
+
+counter()
+{
+    curl -s "http://127.0.0.1:$metrics/" | awk -v name="$1" '$1 == name { print $2 }'
+}
+
+#check NAME EXPECTED
+check()
+{
+    value=$(counter "$1")
+    if [ "$value" = "$2" ]; then
+        echo "  $1 $value"
+    else
+        echo "  $1 $value, expected $2"
+        status=1
+    fi
+}
+
+#clients MODE : ROUNDS SOCKS4 CONNECTs to the black hole, one after another.
+#"wait" reads until the server gives up, "hangup" closes after 0.3 s. the
+#server only notices the hangup when the connect ends, so every round waits
+#out --connect-timeout before the next one takes the --max-tunnels slot
+clients()
+{
+    python3 - "$port" "$1" "$rounds" <<'EOF'
+import socket, struct, sys, time
+port, mode, rounds = int(sys.argv[1]), sys.argv[2], int(sys.argv[3])
+hole = socket.socket()
+hole.bind(('127.0.0.1', 0))
+hole.listen(0)
+#the one connection the backlog takes, later SYNs are dropped
+filler = socket.create_connection(hole.getsockname())
+for i in range(rounds):
+    c = socket.create_connection(('127.0.0.1', port))
+    c.sendall(struct.pack('!BBH4s', 4, 1, hole.getsockname()[1], socket.inet_aton('127.0.0.1')) + b'\0')
+    start = time.time()
+    if mode == 'wait':
+        c.settimeout(5)
+        c.recv(8)
+        print('  connect %d ended after %.1f s' % (i + 1, time.time() - start))
+        c.close()
+    else:
+        time.sleep(0.3)
+        c.close()
+        time.sleep(1)
+    time.sleep(0.2)
+EOF
+}
+
+./socks_server -l off -m "$metrics" --connect-timeout 1 --max-tunnels 1 "$port" &
+pid=$!
+sleep 0.5
+
+echo "$rounds connects timed out by --connect-timeout 1"
+clients wait
+check socks_live_connections 0
+check socks_admission_rejects_total 0
+
+echo "$rounds connects abandoned by the client"
+clients hangup
+check socks_live_connections 0
+check socks_admission_rejects_total 0
+
+kill "$pid"
+wait "$pid" 2>/dev/null
+
+[ "$status" -eq 0 ] && echo "PASS" || echo "FAIL"
+exit "$status"
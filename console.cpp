@@ -1,14 +1,19 @@
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <array>
 #include <string>
 #include <fstream>
+#include <functional>
+#include <map>
 #include <memory>
 #include <utility>
+#include <unistd.h>
 #include <boost/asio.hpp>
 #include <boost/algorithm/string.hpp>
 #include <vector>
 #include <set>
+#include "socks_client.hpp"
 
 using boost::asio::ip::tcp;
 using std::cout;
@@ -18,26 +23,179 @@ using std::string;
 string socks_host;
 string socks_port;
 
-void escape(string &s)
+//appends data to out as the body of a single quoted javascript string of html,
+//in one pass: runs of plain characters are copied as a whole
+void escape(const char *data, std::size_t length, string &out)
 {
-    boost::replace_all(s, "\'", "\\\'");
-    boost::replace_all(s, "&", "&amp;");
-    boost::replace_all(s, ">", "&gt;");
-    boost::replace_all(s, "<", "&lt;");
-    boost::replace_all(s, "\n", "&NewLine;");
-}
-void to_client_res(string id, string response)
-{
-    escape(response);
-    //sprintf(str, "<script>document.getElementById('%s').innerHTML += '%s';</script>", id.c_str(), response.c_str());
-    cout << "<script>document.getElementById('" << id << "').innerHTML += '" << response << "';</script>" << std::flush;
+    const char *end = data + length, *run = data;
+    for (const char *p = data; p != end; p++)
+    {
+        const char *entity;
+        switch (*p)
+        {
+        case '\'':
+            entity = "\\\'";
+            break;
+        case '\\':
+            entity = "\\\\";
+            break;
+        case '&':
+            entity = "&amp;";
+            break;
+        case '>':
+            entity = "&gt;";
+            break;
+        case '<':
+            entity = "&lt;";
+            break;
+        case '\n':
+            entity = "&NewLine;";
+            break;
+        case '\r':
+            entity = "\\r";
+            break;
+        default:
+            continue;
+        }
+        out.append(run, p);
+        out.append(entity);
+        run = p + 1;
+    }
+    out.append(run, end);
 }
-void to_client_cmd(string id, string response)
+
+//the page output of all sessions. scripts are escaped straight into one
+//pending buffer, which goes to stdout once flush_bytes are pending or
+//flush_delay after its first byte, so a busy console writes a few large
+//chunks instead of one per read. the write is asynchronous; with more than
+//max_pending bytes waiting for a slow browser, sessions stop reading until
+//it drains. stdout that epoll cannot watch (a regular file) is written
+//synchronously instead.
+class console_output
 {
-    escape(response);
-    //sprintf(str, "<script>document.getElementById('%s').innerHTML += '<b>%s</b>';</script>", id.c_str(), response.c_str());
-    cout << "<script>document.getElementById('" << id << "').innerHTML += '<b>" << response << "</b>';</script>" << std::flush;
-}
+public:
+    enum
+    {
+        flush_bytes = 16 * 1024,
+        max_pending = 1024 * 1024
+    };
+    static constexpr std::chrono::milliseconds flush_delay{10};
+
+    explicit console_output(boost::asio::io_context &ioc)
+        : stdout_(ioc), timer_(ioc)
+    {
+        boost::system::error_code ec;
+        stdout_.assign(STDOUT_FILENO, ec);
+        blocking_ = bool(ec);
+    }
+
+    void script(const string &id, const char *data, std::size_t length, bool command)
+    {
+        if (failed_)
+            return;
+        pending_ += "<script>document.getElementById('";
+        pending_ += id;
+        pending_ += command ? "').innerHTML += '<b>" : "').innerHTML += '";
+        escape(data, length, pending_);
+        pending_ += command ? "</b>';</script>" : "';</script>";
+        schedule();
+    }
+
+    bool full() const
+    {
+        return pending_.size() >= max_pending;
+    }
+
+    //runs f once the pending output is below max_pending again
+    void when_drained(std::function<void()> f)
+    {
+        waiters_.push_back(std::move(f));
+    }
+
+private:
+    boost::asio::posix::stream_descriptor stdout_;
+    boost::asio::steady_timer timer_;
+    //appended to while writing_ is on its way, then the two swap, so both
+    //keep their capacity
+    string pending_, writing_;
+    bool blocking_ = false;
+    bool busy_ = false;
+    bool timer_armed_ = false;
+    bool failed_ = false;
+    std::vector<std::function<void()>> waiters_;
+
+    void schedule()
+    {
+        if (busy_)
+            return;
+        if (pending_.size() >= flush_bytes)
+            flush();
+        else if (!timer_armed_)
+        {
+            timer_armed_ = true;
+            timer_.expires_after(flush_delay);
+            timer_.async_wait([this](boost::system::error_code) {
+                timer_armed_ = false;
+                if (!busy_ && !pending_.empty())
+                    flush();
+            });
+        }
+    }
+
+    void flush()
+    {
+        writing_.swap(pending_);
+        pending_.clear();
+        if (blocking_)
+        {
+            std::size_t written = 0;
+            while (written < writing_.size())
+            {
+                ssize_t n = ::write(STDOUT_FILENO, writing_.data() + written, writing_.size() - written);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                {
+                    fail(boost::system::error_code(errno, boost::system::system_category()));
+                    break;
+                }
+                written += n;
+            }
+            drained();
+            return;
+        }
+        busy_ = true;
+        boost::asio::async_write(stdout_, boost::asio::buffer(writing_),
+                                 [this](boost::system::error_code ec, std::size_t /*length*/) {
+                                     busy_ = false;
+                                     if (ec)
+                                         fail(ec);
+                                     drained();
+                                     if (!pending_.empty())
+                                         schedule();
+                                 });
+    }
+
+    //the browser is gone, the sessions run on without output
+    void fail(boost::system::error_code ec)
+    {
+        if (!failed_)
+            std::cerr << "stdout: " << ec.message() << endl;
+        failed_ = true;
+        pending_.clear();
+    }
+
+    void drained()
+    {
+        if (full() || waiters_.empty())
+            return;
+        std::vector<std::function<void()>> waiters;
+        waiters.swap(waiters_);
+        for (auto &f : waiters)
+            f();
+    }
+};
+constexpr std::chrono::milliseconds console_output::flush_delay;
 
 class session
     : public std::enable_shared_from_this<session>
@@ -45,9 +203,9 @@ class session
 public:
     string dst_host_, dst_port_, dst_id_;
 
-    session(boost::asio::io_context &ioc,
-            string &host, string &port, string &doc, string &id)
-        : dst_host_(host), dst_port_(port), dst_id_(id), doc_(doc), socket_(ioc), resolver_(ioc)
+    session(boost::asio::io_context &ioc, console_output &output,
+            const string &host, const string &port, const string &doc, const string &id)
+        : dst_host_(host), dst_port_(port), dst_id_(id), doc_(doc), output_(output), socket_(ioc), resolver_(ioc)
     {}
     void start()
     {
@@ -70,7 +228,8 @@ public:
     }
 
 private:
-    string response, doc_;
+    string doc_;
+    console_output &output_;
     std::ifstream file;
     tcp::socket socket_;
     tcp::resolver resolver_;
@@ -79,21 +238,14 @@ private:
         max_length = 1024
     };
     std::array<char, max_length> data_;
+    std::vector<u_char> request_;
+    //the command being sent
+    string cmd_;
 
     void do_socks_request(){
-        std::array<u_char, max_length> request;
-        request[0] = 4;
-        request[1] = 1;
-        request[2] = (u_char) std::stoul(dst_port_) / 256;
-        request[3] = (u_char) std::stoul(dst_port_) % 256;
-        request[4] = request[5] = request[6] = 0;
-        request[7] = 1;
-        request[8] = 0;
-        for(int i = 0; i<dst_host_.length(); i++)
-            request[9+i] = dst_host_[i];
-        request[9 + dst_host_.length()] = 0;
+        request_ = socks4_request(socks4_connect, dst_host_, std::stoul(dst_port_));
         auto self(shared_from_this());
-        socket_.async_send(boost::asio::buffer(request, 10 + dst_host_.length()),
+        boost::asio::async_write(socket_, boost::asio::buffer(request_),
                             [this, self](boost::system::error_code ec, std::size_t length)
                             {
                                 if(!ec){
@@ -104,17 +256,17 @@ private:
 
     void do_socks_reply(){
         auto self(shared_from_this());
-        socket_.async_read_some(boost::asio::buffer(data_),
+        boost::asio::async_read(socket_, boost::asio::buffer(data_, socks4_reply_length),
                                 [this, self](boost::system::error_code ec, std::size_t length)
                                 {
                                     if(!ec){
-                                        if(length !=8 || data_[0] != 0)
+                                        socks4_reply reply = parse_socks4_reply(data_.data(), length);
+                                        if(!reply.valid)
                                             std::cerr << "Bad socks reply\n";
-                                        else if(data_[1] == 91)
+                                        else if(!reply.granted())
                                             std::cerr << "Socks request rejected\n";
-                                        else if(data_[1] == 90){
+                                        else
                                             do_read();
-                                        }
                                     }
                                 });
     }
@@ -126,17 +278,18 @@ private:
                                 [this, self](boost::system::error_code ec, std::size_t length) {
                                     if (!ec)
                                     {
-                                        string res(data_.begin(), data_.begin() + length);
-                                        if (res.find("%") != string::npos)
-                                        {
-                                            to_client_res(dst_id_, res);
-                                            do_write();
-                                        }
+                                        bool prompt = std::memchr(data_.data(), '%', length) != nullptr;
+                                        output_.script(dst_id_, data_.data(), length, false);
+                                        auto next = [this, self, prompt] {
+                                            if (prompt)
+                                                do_write();
+                                            else
+                                                do_read();
+                                        };
+                                        if (output_.full())
+                                            output_.when_drained(next);
                                         else
-                                        {
-                                            to_client_res(dst_id_, res);
-                                            do_read();
-                                        }
+                                            next();
                                     }
                                     else
                                         std::cerr << ec.message() << endl;
@@ -145,13 +298,12 @@ private:
 
     void do_write()
     {
-        string cmd;
-        if (getline(file, cmd))
+        if (getline(file, cmd_))
         {
-            cmd += "\n";
-            to_client_cmd(dst_id_, cmd);
+            cmd_ += "\n";
+            output_.script(dst_id_, cmd_.data(), cmd_.size(), true);
             auto self(shared_from_this());
-            boost::asio::async_write(socket_, boost::asio::buffer(cmd.c_str(), cmd.size()),
+            boost::asio::async_write(socket_, boost::asio::buffer(cmd_),
                                      [this, self](boost::system::error_code ec, std::size_t /*length*/) {
                                          if (!ec)
                                          {
@@ -171,33 +323,45 @@ private:
 class session_manager
 {
 public:
-    session_manager(boost::asio::io_context &io_context) : io_context_(io_context) {}
+    session_manager(boost::asio::io_context &io_context, console_output &output)
+        : io_context_(io_context), output_(output)
+    {}
     std::vector<std::shared_ptr<session>> sessions;
 
+    //hN, pN and fN are host, port and test case of session N, for any number
+    //of sessions; sh and sp name the SOCKS server. forms left empty are skipped
     void parse_query()
     {
-        string query = getenv("QUERY_STRING");
+        const char *env = getenv("QUERY_STRING");
+        string query = env ? env : "";
         std::vector<string> params;
         boost::split(params, query, boost::is_any_of("&"), boost::token_compress_on);
 
-        for (auto it = params.begin(); it != params.end(); it += 3)
+        static const char fields[] = "hpf";
+        std::map<int, std::array<string, 3>> forms;
+        for (const auto &param : params)
         {
-            if ((*it).find("sh") != string::npos)
-            {
-                socks_host = (*it).substr((*it).find("=") + 1);
-                socks_port = (*(it+1)).substr((*(it+1)).find("=") + 1);
-            }
-            if (!boost::ends_with(*it, "="))
-            {
-                string host = (*it).substr((*it).find('=') + 1);
-                string port = (*(it + 1)).substr((*(it + 1)).find('=') + 1);
-                string doc = (*(it + 2)).substr((*(it + 1)).find('=') + 1);
-                string id = "s" + (*it).substr(1, 1);
-                std::cerr << host << " " << port << " " << doc << " " << id << endl;
-
-                auto s = std::make_shared<session>(io_context_, host, port, doc, id);
-                sessions.push_back(s);
-            }
+            std::size_t eq = param.find('=');
+            if (eq == string::npos)
+                continue;
+            string key = param.substr(0, eq), value = param.substr(eq + 1);
+            const char *field = std::strchr(fields, key[0]);
+            if (key == "sh")
+                socks_host = value;
+            else if (key == "sp")
+                socks_port = value;
+            else if (key.size() > 1 && key.size() <= 6 && field && *field &&
+                     key.find_first_not_of("0123456789", 1) == string::npos)
+                forms[std::stoi(key.substr(1))][field - fields] = value;
+        }
+        for (const auto &form : forms)
+        {
+            const auto &f = form.second;
+            if (f[0].empty() || f[1].empty())
+                continue;
+            string id = "s" + std::to_string(form.first);
+            std::cerr << f[0] << " " << f[1] << " " << f[2] << " " << id << endl;
+            sessions.push_back(std::make_shared<session>(io_context_, output_, f[0], f[1], f[2], id));
         }
     }
     void start()
@@ -210,6 +374,7 @@ public:
 
 private:
     boost::asio::io_context &io_context_;
+    console_output &output_;
 };
 
 void prt_html(std::vector<std::shared_ptr<session>> &sessions)
@@ -288,7 +453,8 @@ int main(int argc, char *argv[])
     try
     {
         boost::asio::io_context io_context;
-        session_manager cntl(io_context);
+        console_output output(io_context);
+        session_manager cntl(io_context, output);
         cntl.parse_query();
         prt_html(cntl.sessions);
         cntl.start();
@@ -0,0 +1,78 @@
+#!/bin/sh
+#SOCKS4a name cache: socks_bench sends SOCKS4a requests for "localhost"
+#(answered from /etc/hosts, no DNS server needed) and the server's metrics
+#must show that only the first request of a TTL went to the resolver.
+#
+#usage: ./dns_cache_check.sh [REQUESTS]
+
+n=${1:-200}
+port=${PORT:-1098}
+metrics=${METRICS_PORT:-9198}
+status=0
+
+counter()
+{
+    curl -s "http://127.0.0.1:$metrics/" | awk -v name="$1" '$1 == name { print $2 }'
+}
+
+#check NAME EXPECTED
+check()
+{
+    value=$(counter "$1")
+    if [ "$value" = "$2" ]; then
+        echo "  $1 $value"
+    else
+        echo "  $1 $value, expected $2"
+        status=1
+    fi
+}
+
+#run SERVER_OPTIONS... : starts a server, sets pid
+run()
+{
+    ./socks_server -l off -m "$metrics" "$@" "$port" &
+    pid=$!
+    sleep 0.5
+}
+
+bench()
+{
+    ./socks_bench -s 127.0.0.1:"$port" -a 100 -n "$n" "$@" | grep -q "ok, 0 failed" || {
+        echo "  socks_bench saw failed tunnels"
+        status=1
+    }
+}
+
+stop()
+{
+    kill "$pid"
+    wait "$pid" 2>/dev/null
+}
+
+echo "$n requests one after another: one lookup, the rest from the cache"
+run
+bench -c 1
+check socks_dns_cache_misses_total 1
+check socks_dns_cache_hits_total $((n - 1))
+stop
+
+echo "$n requests, 50 at a time: one lookup, the rest cached or waiting for it"
+run
+bench -c 50
+check socks_dns_cache_misses_total 1
+coalesced=$(counter socks_dns_cache_coalesced_total)
+check socks_dns_cache_hits_total $((n - 1 - coalesced))
+echo "  socks_dns_cache_coalesced_total $coalesced"
+stop
+
+echo "--dns-ttl 1, a second run after the entry expired: one more lookup"
+run --dns-ttl 1
+bench -c 1
+sleep 2
+bench -c 1
+check socks_dns_cache_misses_total 2
+check socks_dns_cache_hits_total $((2 * n - 2))
+stop
+
+[ "$status" -eq 0 ] && echo "PASS" || echo "FAIL"
+exit "$status"
@@ -0,0 +1,404 @@
+#ifndef FIREWALL_RULES_HPP
+#define FIREWALL_RULES_HPP
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio.hpp>
+
+//socks_conf: permit and forward rules, parent proxies and socket profiles.
+//shared by socks_server and the firewall benchmark of socks_bench.
+
+//"parent GROUP HOST:PORT [socks4|socks5]" in socks_conf: one SOCKS proxy of a
+//group that "forward" rules send tunnels through
+struct parent_proxy
+{
+    boost::asio::ip::tcp::endpoint ep;
+    u_char version;
+
+    bool operator<(const parent_proxy &o) const
+    {
+        return std::tie(ep, version) < std::tie(o.ep, o.version);
+    }
+    bool operator==(const parent_proxy &o) const
+    {
+        return ep == o.ep && version == o.version;
+    }
+};
+
+//"profile NAME key=value ..." in socks_conf: TCP options for the client and
+//upstream sockets of the tunnels it is selected for. unset keys leave the
+//kernel defaults alone.
+struct socket_profile
+{
+    std::string name;
+    int nodelay = -1;
+    //probe after this many idle seconds, then every third of it, 3 probes; 0 = off
+    int keepalive = -1;
+    int rcvbuf = 0;
+    int sndbuf = 0;
+    int notsent_lowat = 0;
+
+    bool set(const std::string &key, int value)
+    {
+        if (key == "nodelay")
+            nodelay = value != 0;
+        else if (key == "keepalive")
+            keepalive = value;
+        else if (key == "rcvbuf")
+            rcvbuf = value;
+        else if (key == "sndbuf")
+            sndbuf = value;
+        else if (key == "notsent_lowat")
+            notsent_lowat = value;
+        else
+            return false;
+        return true;
+    }
+
+    //buffer sizes only shape the window scale if set before connect() or
+    //listen(), the rest may change at any time
+    void apply(int fd) const
+    {
+        auto opt = [fd](int level, int name, int value) { setsockopt(fd, level, name, &value, sizeof(value)); };
+        if (nodelay >= 0)
+            opt(IPPROTO_TCP, TCP_NODELAY, nodelay);
+        if (keepalive > 0)
+        {
+            opt(SOL_SOCKET, SO_KEEPALIVE, 1);
+            opt(IPPROTO_TCP, TCP_KEEPIDLE, keepalive);
+            opt(IPPROTO_TCP, TCP_KEEPINTVL, std::max(1, keepalive / 3));
+            opt(IPPROTO_TCP, TCP_KEEPCNT, 3);
+        }
+        else if (keepalive == 0)
+            opt(SOL_SOCKET, SO_KEEPALIVE, 0);
+        if (rcvbuf)
+            opt(SOL_SOCKET, SO_RCVBUF, rcvbuf);
+        if (sndbuf)
+            opt(SOL_SOCKET, SO_SNDBUF, sndbuf);
+        if (notsent_lowat)
+            opt(IPPROTO_TCP, TCP_NOTSENT_LOWAT, notsent_lowat);
+    }
+};
+
+//permit rules from socks_conf, compiled once into mask/value pairs.
+//rules of one command sharing a wildcard mask are kept in a sorted vector,
+//so a lookup costs one binary search per distinct mask (at most 16).
+//
+//socks_conf also names the socket profile of a tunnel: a permit rule may end
+//with a profile name, the most specific matching rule decides; otherwise
+//"port PORT NAME" picks one by destination port, and a profile called
+//"default" covers the rest. profiles are defined before their first use.
+//
+//"forward PATTERN GROUP" sends CONNECT tunnels to matching destinations
+//through the parent proxies of GROUP instead of connecting directly; the
+//most specific pattern decides. the permit rules still apply.
+class firewall_rules
+{
+public:
+    static std::shared_ptr<const firewall_rules> load(const std::string &path)
+    {
+        std::ifstream conf(path);
+        if (!conf.is_open())
+            return nullptr;
+        return load(conf, path);
+    }
+
+    //name is what malformed lines are reported against
+    static std::shared_ptr<const firewall_rules> load(std::istream &conf, const std::string &name)
+    {
+        auto rules = std::make_shared<firewall_rules>();
+        std::string line;
+        int line_no = 0;
+        while (std::getline(conf, line))
+        {
+            line_no++;
+            std::istringstream tokens(line);
+            std::string rule;
+            if (!(tokens >> rule))
+                continue;
+            if (!rules->parse(rule, tokens))
+                std::cerr << name << ":" << line_no << ": bad rule \"" << line << "\"" << std::endl;
+        }
+        //most specific masks first, so the first match names the profile or
+        //parent group; of equal rules the first one in the file stays
+        for (auto &groups : rules->groups_)
+        {
+            std::stable_sort(groups.begin(), groups.end(), [](const rule_group &a, const rule_group &b) {
+                return __builtin_popcount(a.mask) > __builtin_popcount(b.mask);
+            });
+            for (auto &g : groups)
+            {
+                std::stable_sort(g.values.begin(), g.values.end(),
+                                 [](const rule_entry &a, const rule_entry &b) { return a.value < b.value; });
+                g.values.erase(std::unique(g.values.begin(), g.values.end(),
+                                           [](const rule_entry &a, const rule_entry &b) { return a.value == b.value; }),
+                               g.values.end());
+            }
+        }
+        return rules;
+    }
+
+    //the profile for a tunnel allowed by a rule naming profile (or -1) to port
+    const socket_profile *profile(int profile, u_short port) const
+    {
+        if (profile >= 0)
+            return &profiles_[profile];
+        auto it = ports_.find(port);
+        if (it != ports_.end())
+            return &profiles_[it->second];
+        return default_profile();
+    }
+    const socket_profile *default_profile() const
+    {
+        return default_ >= 0 ? &profiles_[default_] : nullptr;
+    }
+
+    //IPv6 destinations can only match rules that are wildcards in every octet.
+    //profile is set to the profile named by the matching rule, -1 for none
+    bool permit(u_char cd, const boost::asio::ip::address &addr, int *profile = nullptr) const
+    {
+        if (cd != 1 && cd != 2)
+            return false;
+        auto e = match(groups_[cd - 1], addr);
+        if (e && profile)
+            *profile = e->tag;
+        return e;
+    }
+
+    bool permit(u_char cd, uint32_t addr, int *profile = nullptr) const
+    {
+        if (cd != 1 && cd != 2)
+            return false;
+        auto e = match(groups_[cd - 1], addr);
+        if (e && profile)
+            *profile = e->tag;
+        return e;
+    }
+
+    //the parents to reach addr through, null to connect directly
+    const std::vector<parent_proxy> *forward(const boost::asio::ip::address &addr) const
+    {
+        auto e = match(groups_[forward_rules], addr);
+        return e ? &parents_[e->tag].proxies : nullptr;
+    }
+
+    //every parent of every group, each once
+    std::vector<parent_proxy> parents() const
+    {
+        std::vector<parent_proxy> all;
+        for (const auto &group : parents_)
+            all.insert(all.end(), group.proxies.begin(), group.proxies.end());
+        std::sort(all.begin(), all.end());
+        all.erase(std::unique(all.begin(), all.end()), all.end());
+        return all;
+    }
+
+private:
+    enum
+    {
+        //groups_[0] and [1] hold the permit rules of CONNECT and BIND
+        forward_rules = 2
+    };
+    struct rule_entry
+    {
+        uint32_t value;
+        //profile of a permit rule, parent group of a forward rule
+        int tag;
+    };
+    struct rule_group
+    {
+        uint32_t mask;
+        std::vector<rule_entry> values;
+    };
+    struct parent_group
+    {
+        std::string name;
+        std::vector<parent_proxy> proxies;
+    };
+    std::vector<rule_group> groups_[3];
+    std::vector<parent_group> parents_;
+    std::vector<socket_profile> profiles_;
+    std::unordered_map<u_short, int> ports_;
+    int default_ = -1;
+
+    bool parse(const std::string &rule, std::istringstream &tokens)
+    {
+        std::string name;
+        if (rule == "profile")
+        {
+            if (!(tokens >> name) || find_profile(name) >= 0)
+                return false;
+            socket_profile p;
+            p.name = name;
+            std::string setting;
+            while (tokens >> setting)
+            {
+                std::size_t eq = setting.find('=');
+                if (eq == std::string::npos || !p.set(setting.substr(0, eq), std::atoi(setting.c_str() + eq + 1)))
+                    return false;
+            }
+            if (name == "default")
+                default_ = profiles_.size();
+            profiles_.push_back(p);
+            return true;
+        }
+        if (rule == "port")
+        {
+            int port;
+            if (!(tokens >> port >> name) || port <= 0 || port > 65535 || find_profile(name) < 0)
+                return false;
+            ports_[port] = find_profile(name);
+            return true;
+        }
+        if (rule == "parent")
+        {
+            std::string dest, version = "socks5";
+            parent_proxy proxy;
+            if (!(tokens >> name >> dest) || (tokens >> version && version != "socks4" && version != "socks5") ||
+                !resolve(dest, proxy.ep))
+                return false;
+            proxy.version = version == "socks4" ? 4 : 5;
+            int group = find_parent(name);
+            if (group < 0)
+            {
+                group = parents_.size();
+                parents_.push_back(parent_group{name, {}});
+            }
+            parents_[group].proxies.push_back(proxy);
+            return true;
+        }
+        uint32_t mask, value;
+        if (rule == "forward")
+        {
+            std::string addr;
+            int group;
+            if (!(tokens >> addr >> name) || (group = find_parent(name)) < 0 || !parse_pattern(addr, mask, value))
+                return false;
+            add(groups_[forward_rules], mask, value, group);
+            return true;
+        }
+        std::string mode, addr;
+        tokens >> mode >> addr;
+        int profile = -1;
+        if (tokens >> name && (profile = find_profile(name)) < 0)
+            return false;
+        if (rule != "permit" || (mode != "c" && mode != "b") || !parse_pattern(addr, mask, value))
+            return false;
+        add(groups_[mode == "c" ? 0 : 1], mask, value, profile);
+        return true;
+    }
+
+    int find_profile(const std::string &name) const
+    {
+        for (std::size_t i = 0; i < profiles_.size(); i++)
+            if (profiles_[i].name == name)
+                return i;
+        return -1;
+    }
+
+    int find_parent(const std::string &name) const
+    {
+        for (std::size_t i = 0; i < parents_.size(); i++)
+            if (parents_[i].name == name)
+                return i;
+        return -1;
+    }
+
+    //HOST:PORT, the first address a host name resolves to
+    static bool resolve(const std::string &dest, boost::asio::ip::tcp::endpoint &ep)
+    {
+        std::size_t colon = dest.rfind(':');
+        if (colon == std::string::npos)
+            return false;
+        boost::asio::io_context io_context;
+        boost::asio::ip::tcp::resolver resolver(io_context);
+        boost::system::error_code ec;
+        auto results = resolver.resolve(dest.substr(0, colon), dest.substr(colon + 1), ec);
+        if (ec || results.empty())
+            return false;
+        ep = results.begin()->endpoint();
+        return true;
+    }
+
+    static void add(std::vector<rule_group> &groups, uint32_t mask, uint32_t value, int tag)
+    {
+        auto it = std::find_if(groups.begin(), groups.end(), [mask](const rule_group &g) { return g.mask == mask; });
+        if (it == groups.end())
+            it = groups.insert(groups.end(), rule_group{mask, {}});
+        it->values.push_back(rule_entry{value, tag});
+    }
+
+    //the most specific rule of groups matching addr, null for none
+    static const rule_entry *match(const std::vector<rule_group> &groups, uint32_t addr)
+    {
+        for (const auto &g : groups)
+        {
+            auto it = std::lower_bound(g.values.begin(), g.values.end(), addr & g.mask,
+                                       [](const rule_entry &e, uint32_t value) { return e.value < value; });
+            if (it != g.values.end() && it->value == (addr & g.mask))
+                return &*it;
+        }
+        return nullptr;
+    }
+
+    static const rule_entry *match(const std::vector<rule_group> &groups, const boost::asio::ip::address &addr)
+    {
+        if (addr.is_v4())
+            return match(groups, addr.to_v4().to_uint());
+        if (addr.to_v6().is_v4_mapped())
+            return match(groups, boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, addr.to_v6()).to_uint());
+        for (const auto &g : groups)
+            if (g.mask == 0)
+                return &g.values[0];
+        return nullptr;
+    }
+
+    //"140.113.*.*" -> mask 0xffff0000, value 0x8c710000
+    static bool parse_pattern(const std::string &addr, uint32_t &mask, uint32_t &value)
+    {
+        mask = value = 0;
+        std::size_t pos = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            if (i > 0)
+            {
+                if (pos >= addr.size() || addr[pos] != '.')
+                    return false;
+                pos++;
+            }
+            uint32_t octet = 0;
+            uint32_t octet_mask = 0xff;
+            if (pos < addr.size() && addr[pos] == '*')
+            {
+                octet_mask = 0;
+                pos++;
+            }
+            else
+            {
+                std::size_t start = pos;
+                while (pos < addr.size() && isdigit((u_char)addr[pos]) && pos - start < 3)
+                    octet = octet * 10 + (addr[pos++] - '0');
+                if (pos == start || octet > 255)
+                    return false;
+            }
+            mask = mask << 8 | octet_mask;
+            value = value << 8 | octet;
+        }
+        return pos == addr.size();
+    }
+};
+
+#endif
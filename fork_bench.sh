@@ -0,0 +1,52 @@
+#!/bin/sh
+#event loop threads against -f (a process per connection) under the same
+#socks_bench load: connections per second, and the memory of the server
+#with all of its children, sampled every 100 ms. forked children share most
+#pages with the parent, so memory is summed as PSS (each shared page split
+#among its users) next to the plain RSS sum.
+#
+#usage: ./fork_bench.sh [socks_bench options]
+#   e.g. ./fork_bench.sh -c 100 -n 20000 -p 16384
+
+[ $# -eq 0 ] && set -- -c 100 -n 20000 -p 16384
+bench_args="$*"
+port=${PORT:-1093}
+out=$(mktemp)
+
+#kb FIELD : FIELD of smaps_rollup summed over the server and its children
+kb()
+{
+    for p in "$pid" $(pgrep -P "$pid"); do
+        cat /proc/"$p"/smaps_rollup 2>/dev/null
+    done | awk -v field="$1:" '$1 == field { kb += $2 } END { print kb + 0 }'
+}
+
+#run LABEL SERVER_OPTIONS
+run()
+{
+    ./socks_server -l off $2 "$port" &
+    pid=$!
+    sleep 0.5
+    ./socks_bench -s 127.0.0.1:"$port" $bench_args >"$out" 2>&1 &
+    bench=$!
+    peak_pss=0
+    peak_rss=0
+    peak_procs=0
+    while kill -0 "$bench" 2>/dev/null; do
+        pss=$(kb Pss)
+        rss=$(kb Rss)
+        procs=$(($(pgrep -P "$pid" | wc -l) + 1))
+        [ "$pss" -gt "$peak_pss" ] && peak_pss=$pss
+        [ "$rss" -gt "$peak_rss" ] && peak_rss=$rss
+        [ "$procs" -gt "$peak_procs" ] && peak_procs=$procs
+        sleep 0.1
+    done
+    kill "$pid"
+    wait "$pid" 2>/dev/null
+    echo "$1: $(grep '^tunnels:' "$out")"
+    echo "$1: peak $peak_procs processes, $peak_pss KB PSS, $peak_rss KB RSS summed"
+}
+
+run threads "-t 1"
+run fork -f
+rm -f "$out"
@@ -0,0 +1,60 @@
+//libFuzzer target for socks4_parser: make fuzz, then ./fuzz/socks4_parser_fuzz
+//
+//the first input byte picks the read size the rest arrives in. every call
+//gets the bytes received so far in an allocation of exactly that length, so
+//AddressSanitizer reports any read at or past it, and a finished request
+//must point into that buffer and match a parse of the whole input at once.
+
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include "socks4_parser.hpp"
+
+static bool inside(boost::string_view v, const u_char *data, std::size_t length)
+{
+    const u_char *p = reinterpret_cast<const u_char *>(v.data());
+    return v.empty() || (p >= data && p + v.size() <= data + length);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *input, std::size_t size)
+{
+    if (size == 0)
+        return 0;
+    std::size_t step = input[0] % 16 + 1;
+    const u_char *request = input + 1;
+    std::size_t total = size - 1;
+
+    socks4_parser parser;
+    socks4_parsed out;
+    socks4_parse_result result = socks4_incomplete;
+    std::size_t length = 0;
+    while (result == socks4_incomplete && length < total)
+    {
+        length = std::min(total, length + step);
+        std::unique_ptr<u_char[]> received(new u_char[length]);
+        std::memcpy(received.get(), request, length);
+        result = parser.parse(received.get(), length, out);
+        if (result == socks4_complete)
+        {
+            if (parser.length() > length || !inside(out.user_id, received.get(), length) ||
+                !inside(out.domain, received.get(), length))
+                std::abort();
+            //offsets, as the views die with this buffer
+            std::size_t user_id = reinterpret_cast<const u_char *>(out.user_id.data()) - received.get();
+            std::size_t domain = out.domain.empty() ? 0 : reinterpret_cast<const u_char *>(out.domain.data()) - received.get();
+
+            std::unique_ptr<u_char[]> whole(new u_char[total]);
+            std::memcpy(whole.get(), request, total);
+            socks4_parser once;
+            socks4_parsed expected;
+            if (once.parse(whole.get(), total, expected) != socks4_complete || once.length() != parser.length() ||
+                expected.cd != out.cd || expected.port != out.port || expected.ip != out.ip ||
+                expected.user_id.size() != out.user_id.size() ||
+                reinterpret_cast<const u_char *>(expected.user_id.data()) - whole.get() != std::ptrdiff_t(user_id) ||
+                expected.domain.size() != out.domain.size() ||
+                (!out.domain.empty() && reinterpret_cast<const u_char *>(expected.domain.data()) - whole.get() != std::ptrdiff_t(domain)))
+                std::abort();
+        }
+    }
+    return 0;
+}
@@ -1,7 +1,14 @@
 #! /usr/bin/env python3
 import os
+from urllib.parse import parse_qs
 
-N_SERVERS = 5
+# panel_socks.cgi?n=200 shows 200 session forms, up to MAX_SERVERS; the
+# console takes any number
+MAX_SERVERS = 1000
+try:
+    N_SERVERS = min(MAX_SERVERS, max(1, int(parse_qs(os.environ.get('QUERY_STRING', '')).get('n', ['5'])[0])))
+except ValueError:
+    N_SERVERS = 5
 
 FORM_METHOD = 'GET'
 FORM_ACTION = 'hw4.cgi'
@@ -0,0 +1,35 @@
+#!/bin/sh
+#one-way relay throughput: socks_bench --bulk through a fresh server, RUNS
+#times, with the CPU time the server spent per GiB (from /proc/PID/stat)
+#
+#usage: ./relay_bench.sh [MIB] [RUNS]
+#SERVER_ARGS (default "-t 1") is passed to the server, e.g. "-t 1 -z"
+
+mib=${1:-1024}
+runs=${2:-3}
+port=${PORT:-1096}
+server_args=${SERVER_ARGS:--t 1}
+hz=$(getconf CLK_TCK)
+status=0
+
+cpu_ticks()
+{
+    awk '{ print $14 + $15 }' /proc/"$pid"/stat
+}
+
+./socks_server $server_args -l off "$port" &
+pid=$!
+sleep 0.5
+
+i=0
+while [ "$i" -lt "$runs" ]; do
+    before=$(cpu_ticks)
+    result=$(./socks_bench -s 127.0.0.1:"$port" --bulk "$mib") || status=1
+    after=$(cpu_ticks)
+    echo "$result, server $(echo "$before $after $hz $mib" | awk '{ printf "%.2f", ($2 - $1) / $3 * 1024 / $4 }') s CPU per GiB"
+    i=$((i + 1))
+done
+
+kill "$pid"
+wait "$pid" 2>/dev/null
+exit "$status"
@@ -0,0 +1,63 @@
+#!/bin/sh
+#hot restart under load: socks_bench keeps tunnels going through a server
+#that is replaced by a new --handoff process RESTARTS times during the run.
+#fails unless every tunnel succeeded and every replaced server exited.
+#
+#usage: ./restart_bench.sh [RESTARTS] [socks_bench options]
+#   e.g. ./restart_bench.sh 3 -c 50 -n 60000 -p 512
+#SERVER_ARGS (default "-t 2") is passed to every server, e.g. --io-uring
+
+restarts=${1:-3}
+[ $# -gt 0 ] && shift
+[ $# -eq 0 ] && set -- -c 50 -n 60000 -p 512
+port=${PORT:-1099}
+handoff=${HANDOFF:-/tmp/socks_restart_bench.sock}
+server_args=${SERVER_ARGS:--t 2}
+out=$(mktemp)
+
+start_server()
+{
+    ./socks_server $server_args -l off --handoff "$handoff" "$port" 2>>"$out.server" &
+    pid=$!
+}
+
+start_server
+sleep 0.5
+./socks_bench -s 127.0.0.1:"$port" "$@" >"$out" 2>&1 &
+bench=$!
+
+status=0
+i=0
+while [ "$i" -lt "$restarts" ]; do
+    sleep 1
+    if ! kill -0 "$bench" 2>/dev/null; then
+        echo "socks_bench finished after $i restarts, use a larger -n"
+        status=1
+        break
+    fi
+    old=$pid
+    start_server
+    #the old server exits once drained, within --drain-timeout (30 s)
+    waited=0
+    while kill -0 "$old" 2>/dev/null && [ "$waited" -lt 35 ]; do
+        sleep 1
+        waited=$((waited + 1))
+    done
+    if kill -0 "$old" 2>/dev/null; then
+        echo "replaced server $old did not exit"
+        kill "$old"
+        status=1
+    fi
+    i=$((i + 1))
+    echo "restart $i: $old -> $pid"
+done
+
+wait "$bench"
+kill "$pid" 2>/dev/null
+wait "$pid" 2>/dev/null
+cat "$out"
+grep "listeners handed over" "$out.server"
+grep -q "tunnels: .* ok, 0 failed" "$out" || status=1
+rm -f "$out" "$out.server"
+[ "$status" -eq 0 ] && echo "PASS" || echo "FAIL"
+exit "$status"
@@ -0,0 +1,146 @@
+#ifndef SOCKS4_PARSER_HPP
+#define SOCKS4_PARSER_HPP
+
+#include <sys/types.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <boost/utility/string_view.hpp>
+
+//server side SOCKS4/4a request parser, shared by socks_server and the parse
+//benchmark of socks_bench. it works in place on the caller's receive buffer:
+//the parsed request points into it, nothing is copied or allocated, and no
+//byte at or past the received length is read. fed again after every read,
+//it resumes scanning where the previous call stopped.
+
+enum socks4_parse_result
+{
+    socks4_incomplete,
+    socks4_complete,
+    //not a SOCKS4 request, or a malformed one
+    socks4_bad,
+    //well formed, but neither CONNECT nor BIND
+    socks4_unsupported
+};
+
+struct socks4_parsed
+{
+    u_char cd = 0;
+    u_short port = 0;
+    //host byte order, 0.0.0.x for SOCKS4a
+    uint32_t ip = 0;
+    boost::string_view user_id;
+    //SOCKS4a only
+    boost::string_view domain;
+};
+
+namespace socks4_detail
+{
+struct byte_table
+{
+    bool set[256];
+};
+
+constexpr byte_table command_table()
+{
+    byte_table t{};
+    t.set[1] = t.set[2] = true;
+    return t;
+}
+
+//what getaddrinfo is handed: letters, digits, '-', '_' and '.'
+constexpr byte_table domain_table()
+{
+    byte_table t{};
+    for (int c = 'a'; c <= 'z'; c++)
+        t.set[c] = t.set[c - 'a' + 'A'] = true;
+    for (int c = '0'; c <= '9'; c++)
+        t.set[c] = true;
+    t.set[(u_char)'-'] = t.set[(u_char)'_'] = t.set[(u_char)'.'] = true;
+    return t;
+}
+
+constexpr byte_table commands = command_table();
+constexpr byte_table domain_chars = domain_table();
+} // namespace socks4_detail
+
+class socks4_parser
+{
+public:
+    enum
+    {
+        header_length = 8,
+        max_domain_length = 255
+    };
+
+    //data holds the first length bytes of the request, including those of
+    //earlier calls
+    socks4_parse_result parse(const u_char *data, std::size_t length, socks4_parsed &out)
+    {
+        if (length < header_length)
+            return socks4_incomplete;
+        if (data[0] != 4)
+            return socks4_bad;
+        out.cd = data[1];
+        out.port = data[2] << 8 | data[3];
+        out.ip = uint32_t(data[4]) << 24 | uint32_t(data[5]) << 16 | uint32_t(data[6]) << 8 | data[7];
+        if (!socks4_detail::commands.set[out.cd])
+            return socks4_unsupported;
+
+        if (!user_end_)
+        {
+            const void *nul = std::memchr(data + scanned_, 0, length - scanned_);
+            if (!nul)
+            {
+                scanned_ = length;
+                return socks4_incomplete;
+            }
+            user_end_ = static_cast<const u_char *>(nul) - data;
+            scanned_ = user_end_ + 1;
+        }
+        out.user_id = boost::string_view(reinterpret_cast<const char *>(data + header_length), user_end_ - header_length);
+        out.domain = boost::string_view();
+        if (out.ip >> 8 != 0 || out.ip == 0)
+        {
+            length_ = user_end_ + 1;
+            return socks4_complete;
+        }
+
+        //SOCKS4a: the domain follows the user ID, checked while it is searched
+        std::size_t domain = user_end_ + 1;
+        for (; scanned_ < length; scanned_++)
+        {
+            u_char c = data[scanned_];
+            if (c == 0)
+                break;
+            if (!socks4_detail::domain_chars.set[c] || scanned_ - domain >= max_domain_length)
+                return socks4_bad;
+        }
+        if (scanned_ == length)
+            return socks4_incomplete;
+        if (scanned_ == domain)
+            return socks4_bad;
+        out.domain = boost::string_view(reinterpret_cast<const char *>(data + domain), scanned_ - domain);
+        length_ = scanned_ + 1;
+        return socks4_complete;
+    }
+
+    //bytes of the complete request
+    std::size_t length() const
+    {
+        return length_;
+    }
+
+    void reset()
+    {
+        *this = socks4_parser();
+    }
+
+private:
+    //next byte to look at, offset of the user ID's terminator (0 = not found yet)
+    std::size_t scanned_ = header_length;
+    std::size_t user_end_ = 0;
+    std::size_t length_ = 0;
+};
+
+#endif
@@ -0,0 +1,1204 @@
+#include <stdlib.h>
+#include <malloc.h>
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+#include <utility>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <vector>
+#include <array>
+#include <random>
+#include <sstream>
+#include <boost/asio.hpp>
+#include "socks_client.hpp"
+#include "socks4_parser.hpp"
+#include "firewall_rules.hpp"
+#include "admission.hpp"
+#include "timing_wheel.hpp"
+
+using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::shared_ptr;
+using std::string;
+
+enum
+{
+    max_length = 16384
+};
+
+struct bench_options
+{
+    string socks_host = "127.0.0.1";
+    unsigned short socks_port = 1080;
+    //tunnels kept open at the same time
+    unsigned concurrency = 100;
+    unsigned tunnels = 10000;
+    //bytes echoed through every tunnel after the handshake
+    std::size_t payload = 0;
+    //percentage of BIND and SOCKS4a requests, the rest are plain CONNECTs
+    unsigned bind_percent = 0;
+    unsigned socks4a_percent = 0;
+    unsigned threads = 1;
+    //echo server: fixed port (0 = any) and a delay before serving each accepted connection
+    unsigned short echo_port = 0;
+    std::chrono::milliseconds accept_delay{0};
+    //UDP mode: -c associations for this long, each with a window of datagrams in flight
+    unsigned udp_seconds = 0;
+    unsigned udp_window = 8;
+    //parser benchmark: rounds over the sample requests, no server involved
+    unsigned parse_rounds = 0;
+    //firewall benchmark: lookups per rule set size, no server involved
+    unsigned firewall_lookups = 0;
+    //admission benchmark: tunnels held from as many clients, no server involved
+    unsigned admission_clients = 0;
+    //timer benchmark: timers armed at once, no server involved
+    unsigned timer_count = 0;
+    //write-write-read rounds through a single tunnel
+    unsigned wwr_rounds = 0;
+    //bulk mode: MiB sent one way through a single tunnel
+    unsigned bulk_mib = 0;
+    //how long a tunnel stays open after its payload, e.g. to measure idle tunnels
+    std::chrono::seconds hold{0};
+};
+bench_options options;
+
+//results of all tunnels, merged once per finished tunnel
+struct bench_stats
+{
+    std::mutex mutex;
+    std::vector<double> handshake_ms;
+    std::vector<double> ttfb_ms;
+    unsigned ok = 0, failed = 0;
+    unsigned by_command[3] = {0, 0, 0};
+    uint64_t bytes = 0;
+    uint64_t datagrams = 0;
+};
+bench_stats stats;
+
+//the bundled upstream: echoes everything back until the peer closes.
+//--accept-delay stands in for a slow upstream that is late to serve a new connection
+class echo_session
+    : public std::enable_shared_from_this<echo_session>
+{
+public:
+    echo_session(tcp::socket socket) : socket_(std::move(socket)), timer_(socket_.get_executor()) {}
+    void start()
+    {
+        if (options.accept_delay.count() == 0)
+        {
+            do_read();
+            return;
+        }
+        auto self(shared_from_this());
+        timer_.expires_after(options.accept_delay);
+        timer_.async_wait([this, self](boost::system::error_code ec) {
+            if (!ec)
+                do_read();
+        });
+    }
+
+private:
+    tcp::socket socket_;
+    boost::asio::steady_timer timer_;
+    std::array<char, max_length> data_;
+
+    void do_read()
+    {
+        auto self(shared_from_this());
+        socket_.async_read_some(boost::asio::buffer(data_),
+                                [this, self](boost::system::error_code ec, std::size_t length) {
+                                    if (!ec)
+                                        do_write(length);
+                                });
+    }
+
+    void do_write(std::size_t length)
+    {
+        auto self(shared_from_this());
+        boost::asio::async_write(socket_, boost::asio::buffer(data_, length),
+                                 [this, self](boost::system::error_code ec, std::size_t /*length*/) {
+                                     if (!ec)
+                                         do_read();
+                                 });
+    }
+};
+
+class echo_server
+{
+public:
+    echo_server(boost::asio::io_context &io_context)
+        : acceptor_(io_context, tcp::endpoint(boost::asio::ip::address_v4::loopback(), options.echo_port))
+    {
+        do_accept();
+    }
+    tcp::endpoint endpoint() const
+    {
+        return acceptor_.local_endpoint();
+    }
+
+private:
+    tcp::acceptor acceptor_;
+
+    void do_accept()
+    {
+        acceptor_.async_accept([this](boost::system::error_code ec, tcp::socket socket) {
+            if (!ec)
+                std::make_shared<echo_session>(std::move(socket))->start();
+            do_accept();
+        });
+    }
+};
+
+//upstream for --bulk: reads and drops everything, closes on EOF
+class discard_session
+    : public std::enable_shared_from_this<discard_session>
+{
+public:
+    discard_session(tcp::socket socket, uint64_t &received) : socket_(std::move(socket)), received_(received) {}
+    void start()
+    {
+        auto self(shared_from_this());
+        socket_.async_read_some(boost::asio::buffer(data_),
+                                [this, self](boost::system::error_code ec, std::size_t length) {
+                                    received_ += length;
+                                    if (!ec)
+                                        start();
+                                });
+    }
+
+private:
+    tcp::socket socket_;
+    uint64_t &received_;
+    std::array<char, 256 * 1024> data_;
+};
+
+class discard_server
+{
+public:
+    discard_server(boost::asio::io_context &io_context)
+        : acceptor_(io_context, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0))
+    {
+        do_accept();
+    }
+    tcp::endpoint endpoint() const
+    {
+        return acceptor_.local_endpoint();
+    }
+    uint64_t received() const
+    {
+        return received_;
+    }
+
+private:
+    tcp::acceptor acceptor_;
+    uint64_t received_ = 0;
+
+    void do_accept()
+    {
+        acceptor_.async_accept([this](boost::system::error_code ec, tcp::socket socket) {
+            if (!ec)
+                std::make_shared<discard_session>(std::move(socket), received_)->start();
+            do_accept();
+        });
+    }
+};
+
+//upstream for --wwr: answers every 200 byte request with 10 bytes, i.e.
+//only once both writes of a round have arrived
+class request_server
+{
+public:
+    enum
+    {
+        request_length = 200,
+        response_length = 10
+    };
+
+    request_server(boost::asio::io_context &io_context)
+        : acceptor_(io_context, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)), socket_(io_context)
+    {
+        acceptor_.async_accept(socket_, [this](boost::system::error_code ec) {
+            if (ec)
+                return;
+            socket_.set_option(tcp::no_delay(true), ec);
+            do_read();
+        });
+    }
+    tcp::endpoint endpoint() const
+    {
+        return acceptor_.local_endpoint();
+    }
+
+private:
+    tcp::acceptor acceptor_;
+    tcp::socket socket_;
+    std::array<char, request_length> request_;
+    std::array<char, response_length> response_{};
+
+    void do_read()
+    {
+        boost::asio::async_read(socket_, boost::asio::buffer(request_), [this](boost::system::error_code ec, std::size_t) {
+            if (ec)
+                return;
+            boost::asio::async_write(socket_, boost::asio::buffer(response_), [this](boost::system::error_code ec, std::size_t) {
+                if (!ec)
+                    do_read();
+            });
+        });
+    }
+};
+
+//UDP counterpart of the echo server, one datagram per syscall
+class udp_echo_server
+{
+public:
+    udp_echo_server(boost::asio::io_context &io_context)
+        : socket_(io_context, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0))
+    {
+        do_read();
+    }
+    udp::endpoint endpoint() const
+    {
+        return socket_.local_endpoint();
+    }
+
+private:
+    udp::socket socket_;
+    udp::endpoint from_;
+    std::array<char, 65536> data_;
+
+    void do_read()
+    {
+        socket_.async_receive_from(boost::asio::buffer(data_), from_,
+                                   [this](boost::system::error_code ec, std::size_t length) {
+                                       if (ec)
+                                           return;
+                                       socket_.send_to(boost::asio::buffer(data_, length), from_, 0, ec);
+                                       do_read();
+                                   });
+    }
+};
+
+//one UDP ASSOCIATE: keeps --udp-window datagrams echoing through the proxy
+//until the run ends. a window lost to drops is refilled after a quiet tick.
+class bench_flow
+    : public std::enable_shared_from_this<bench_flow>
+{
+public:
+    bench_flow(boost::asio::io_context &io_context, const tcp::endpoint &proxy, const udp::endpoint &echo)
+        : control_(io_context), socket_(io_context), timer_(io_context), proxy_(proxy), echo_(echo)
+    {}
+    void start()
+    {
+        request_ = socks5_request(socks5_udp_associate, boost::asio::ip::address_v4::any(), 0);
+        auto self(shared_from_this());
+        control_.async_connect(proxy_, [this, self](boost::system::error_code ec) {
+            if (ec)
+                return;
+            boost::asio::async_write(control_, boost::asio::buffer(request_),
+                                     [this, self](boost::system::error_code ec, std::size_t) {
+                                         if (ec)
+                                             return;
+                                         read_reply();
+                                     });
+        });
+    }
+    void stop()
+    {
+        boost::system::error_code ec;
+        control_.close(ec);
+        socket_.close(ec);
+        timer_.cancel();
+    }
+    uint64_t received() const
+    {
+        return received_;
+    }
+
+private:
+    tcp::socket control_;
+    udp::socket socket_;
+    boost::asio::steady_timer timer_;
+    tcp::endpoint proxy_;
+    udp::endpoint echo_, relay_, from_;
+    std::vector<u_char> request_, out_;
+    std::array<u_char, 2 + socks5_ipv4_reply_length> reply_;
+    std::array<u_char, 65536> in_;
+    uint64_t received_ = 0, last_tick_ = 0;
+
+    void read_reply()
+    {
+        auto self(shared_from_this());
+        boost::asio::async_read(control_, boost::asio::buffer(reply_),
+                                [this, self](boost::system::error_code ec, std::size_t length) {
+                                    if (ec || !parse_socks5_reply(reply_.data(), length, relay_))
+                                        return;
+                                    socket_.open(udp::v4(), ec);
+                                    socket_.bind(udp::endpoint(boost::asio::ip::address_v4::loopback(), 0), ec);
+                                    out_.assign(socks5_ipv4_udp_header + (options.payload ? options.payload : 64), 'x');
+                                    socks5_udp_header(out_.data(), echo_);
+                                    do_read();
+                                    refill();
+                                    tick();
+                                });
+    }
+
+    void refill()
+    {
+        boost::system::error_code ec;
+        for (unsigned i = 0; i < options.udp_window; i++)
+            socket_.send_to(boost::asio::buffer(out_), relay_, 0, ec);
+    }
+
+    void tick()
+    {
+        auto self(shared_from_this());
+        timer_.expires_after(std::chrono::milliseconds(200));
+        timer_.async_wait([this, self](boost::system::error_code ec) {
+            if (ec)
+                return;
+            if (received_ == last_tick_)
+                refill();
+            last_tick_ = received_;
+            tick();
+        });
+    }
+
+    void do_read()
+    {
+        auto self(shared_from_this());
+        socket_.async_receive_from(boost::asio::buffer(in_), from_,
+                                   [this, self](boost::system::error_code ec, std::size_t /*length*/) {
+                                       if (ec)
+                                           return;
+                                       received_++;
+                                       socket_.send_to(boost::asio::buffer(out_), relay_, 0, ec);
+                                       do_read();
+                                   });
+    }
+};
+
+//--bulk: one CONNECT tunnel to the discard server, then --bulk MiB one way
+//and a half close. done once the proxy closes the tunnel, i.e. after the
+//discard server has read everything and seen EOF.
+class bulk_transfer
+    : public std::enable_shared_from_this<bulk_transfer>
+{
+public:
+    bulk_transfer(boost::asio::io_context &io_context, const tcp::endpoint &proxy, const tcp::endpoint &sink)
+        : io_context_(io_context), socket_(io_context), proxy_(proxy), sink_(sink), out_(1024 * 1024, 'x')
+    {}
+    void start()
+    {
+        request_ = socks4_request(socks4_connect, sink_.address().to_string(), sink_.port());
+        auto self(shared_from_this());
+        socket_.async_connect(proxy_, [this, self](boost::system::error_code ec) {
+            if (ec)
+                return finish(false);
+            boost::asio::async_write(socket_, boost::asio::buffer(request_),
+                                     [this, self](boost::system::error_code ec, std::size_t) {
+                                         if (ec)
+                                             return finish(false);
+                                         boost::asio::async_read(socket_, boost::asio::buffer(reply_),
+                                                                 [this, self](boost::system::error_code ec, std::size_t length) {
+                                                                     if (ec || !parse_socks4_reply(reply_.data(), length).granted())
+                                                                         return finish(false);
+                                                                     started_ = std::chrono::steady_clock::now();
+                                                                     do_write();
+                                                                 });
+                                     });
+        });
+    }
+    bool done() const
+    {
+        return done_;
+    }
+    double seconds() const
+    {
+        return std::chrono::duration<double>(finished_ - started_).count();
+    }
+
+private:
+    boost::asio::io_context &io_context_;
+    tcp::socket socket_;
+    tcp::endpoint proxy_, sink_;
+    std::vector<u_char> request_;
+    std::array<u_char, socks4_reply_length> reply_;
+    std::vector<char> out_;
+    unsigned sent_mib_ = 0;
+    bool done_ = false;
+    std::chrono::steady_clock::time_point started_, finished_;
+
+    void do_write()
+    {
+        if (sent_mib_ == options.bulk_mib)
+        {
+            boost::system::error_code ec;
+            socket_.shutdown(tcp::socket::shutdown_send, ec);
+            wait_close();
+            return;
+        }
+        auto self(shared_from_this());
+        boost::asio::async_write(socket_, boost::asio::buffer(out_),
+                                 [this, self](boost::system::error_code ec, std::size_t) {
+                                     if (ec)
+                                         return finish(false);
+                                     sent_mib_++;
+                                     do_write();
+                                 });
+    }
+
+    void wait_close()
+    {
+        auto self(shared_from_this());
+        socket_.async_read_some(boost::asio::buffer(reply_),
+                                [this, self](boost::system::error_code ec, std::size_t) {
+                                    if (!ec)
+                                        return wait_close();
+                                    finish(ec == boost::asio::error::eof);
+                                });
+    }
+
+    void finish(bool ok)
+    {
+        finished_ = std::chrono::steady_clock::now();
+        done_ = ok;
+        io_context_.stop();
+    }
+};
+
+//one tunnel through the proxy: handshake, optional echo payload, close
+class bench_tunnel
+    : public std::enable_shared_from_this<bench_tunnel>
+{
+public:
+    bench_tunnel(boost::asio::io_context &io_context, const tcp::endpoint &proxy, const tcp::endpoint &echo,
+                 u_char kind, std::function<void()> done)
+        : strand_(boost::asio::make_strand(io_context)), socket_(strand_), peer_(strand_), hold_(strand_),
+          proxy_(proxy), echo_(echo), kind_(kind), done_(std::move(done))
+    {}
+
+    //kind: 0 connect, 1 bind, 2 socks4a
+    void start()
+    {
+        started_ = std::chrono::steady_clock::now();
+        if (kind_ == 2)
+            request_ = socks4_request(socks4_connect, "localhost", echo_.port());
+        else
+            request_ = socks4_request(kind_ == 1 ? socks4_bind : socks4_connect,
+                                      echo_.address().to_string(), echo_.port());
+        auto self(shared_from_this());
+        socket_.async_connect(proxy_, [this, self](boost::system::error_code ec) {
+            if (ec)
+                return finish(false);
+            boost::asio::async_write(socket_, boost::asio::buffer(request_),
+                                     [this, self](boost::system::error_code ec, std::size_t) {
+                                         if (ec)
+                                             return finish(false);
+                                         read_reply();
+                                     });
+        });
+    }
+
+private:
+    //both sockets of a tunnel complete on one strand when -t > 1
+    boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+    tcp::socket socket_;
+    //BIND only: the connection the proxy accepts on its side
+    tcp::socket peer_;
+    boost::asio::steady_timer hold_;
+    tcp::endpoint proxy_, echo_;
+    u_char kind_;
+    std::function<void()> done_;
+    std::vector<u_char> request_;
+    std::array<u_char, socks4_reply_length> reply_;
+    std::vector<char> out_, in_;
+    std::array<char, max_length> peer_data_;
+    std::size_t sent_ = 0;
+    std::chrono::steady_clock::time_point started_;
+    double handshake_ms_ = 0;
+    double ttfb_ms_ = 0;
+    bool second_reply_ = false;
+    bool held_ = false;
+
+    void read_reply()
+    {
+        auto self(shared_from_this());
+        boost::asio::async_read(socket_, boost::asio::buffer(reply_),
+                                [this, self](boost::system::error_code ec, std::size_t length) {
+                                    socks4_reply reply = parse_socks4_reply(reply_.data(), length);
+                                    if (ec || !reply.granted())
+                                        return finish(false);
+                                    if (kind_ == 1 && !second_reply_)
+                                    {
+                                        second_reply_ = true;
+                                        connect_peer(reply.port);
+                                        read_reply();
+                                        return;
+                                    }
+                                    handshake_ms_ = since_start_ms();
+                                    start_payload();
+                                });
+    }
+
+    //plays the remote side of a BIND and echoes like the echo server
+    void connect_peer(unsigned short port)
+    {
+        auto self(shared_from_this());
+        peer_.async_connect(tcp::endpoint(proxy_.address(), port), [this, self](boost::system::error_code ec) {
+            if (!ec)
+                peer_read();
+        });
+    }
+
+    void peer_read()
+    {
+        auto self(shared_from_this());
+        peer_.async_read_some(boost::asio::buffer(peer_data_),
+                              [this, self](boost::system::error_code ec, std::size_t length) {
+                                  if (ec)
+                                      return;
+                                  boost::asio::async_write(peer_, boost::asio::buffer(peer_data_, length),
+                                                           [this, self](boost::system::error_code ec, std::size_t) {
+                                                               if (!ec)
+                                                                   peer_read();
+                                                           });
+                              });
+    }
+
+    void start_payload()
+    {
+        if (options.payload == 0)
+            return finish(true);
+        out_.assign(std::min<std::size_t>(options.payload, max_length), 'x');
+        in_.resize(out_.size());
+        do_write();
+    }
+
+    void do_write()
+    {
+        std::size_t chunk = std::min(out_.size(), options.payload - sent_);
+        auto self(shared_from_this());
+        boost::asio::async_write(socket_, boost::asio::buffer(out_, chunk),
+                                 [this, self](boost::system::error_code ec, std::size_t length) {
+                                     if (ec)
+                                         return finish(false);
+                                     boost::asio::async_read(socket_, boost::asio::buffer(in_, length),
+                                                             [this, self](boost::system::error_code ec, std::size_t length) {
+                                                                 if (ec)
+                                                                     return finish(false);
+                                                                 if (sent_ == 0)
+                                                                     ttfb_ms_ = since_start_ms();
+                                                                 sent_ += length;
+                                                                 if (sent_ < options.payload)
+                                                                     do_write();
+                                                                 else
+                                                                     finish(true);
+                                                             });
+                                 });
+    }
+
+    double since_start_ms() const
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started_).count();
+    }
+
+    void finish(bool ok)
+    {
+        if (ok && options.hold.count() && !held_)
+        {
+            held_ = true;
+            auto self(shared_from_this());
+            hold_.expires_after(options.hold);
+            hold_.async_wait([this, self](boost::system::error_code) { finish(true); });
+            return;
+        }
+        boost::system::error_code ec;
+        socket_.close(ec);
+        peer_.close(ec);
+        {
+            std::lock_guard<std::mutex> lock(stats.mutex);
+            if (ok)
+            {
+                stats.ok++;
+                stats.handshake_ms.push_back(handshake_ms_);
+                if (options.payload)
+                    stats.ttfb_ms.push_back(ttfb_ms_);
+                stats.by_command[kind_]++;
+                stats.bytes += sent_;
+            }
+            else
+                stats.failed++;
+        }
+        done_();
+    }
+};
+
+//keeps options.concurrency tunnels in flight until options.tunnels were started
+class load_generator
+{
+public:
+    load_generator(boost::asio::io_context &io_context, const tcp::endpoint &proxy, const tcp::endpoint &echo)
+        : io_context_(io_context), proxy_(proxy), echo_(echo)
+    {}
+    void start()
+    {
+        for (unsigned i = 0; i < options.concurrency; i++)
+            next();
+    }
+
+private:
+    boost::asio::io_context &io_context_;
+    tcp::endpoint proxy_, echo_;
+    std::atomic<unsigned> started_{0};
+    std::atomic<unsigned> finished_{0};
+
+    void next()
+    {
+        unsigned n = started_++;
+        if (n >= options.tunnels)
+            return;
+        //spread the request kinds evenly instead of randomly, so runs are reproducible
+        unsigned slot = n % 100;
+        u_char kind = slot < options.bind_percent ? 1 : slot < options.bind_percent + options.socks4a_percent ? 2 : 0;
+        std::make_shared<bench_tunnel>(io_context_, proxy_, echo_, kind, [this] {
+            if (++finished_ == options.tunnels)
+                io_context_.stop();
+            else
+                next();
+        })->start();
+    }
+};
+
+double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    std::size_t i = std::min(sorted.size() - 1, (std::size_t)(p / 100 * sorted.size()));
+    return sorted[i];
+}
+
+void report_udp(double seconds, double cpu_seconds)
+{
+    cout << "flows:     " << stats.ok << " echoing, " << stats.failed << " silent\n"
+         << "udp:       " << stats.datagrams << " datagrams of " << (options.payload ? options.payload : 64)
+         << " bytes in " << seconds << " s (" << stats.datagrams / seconds << " pps)\n"
+         << "client:    " << cpu_seconds * 1e6 / std::max<uint64_t>(1, stats.datagrams) << " us cpu per datagram\n";
+}
+
+void report(double seconds)
+{
+    std::sort(stats.handshake_ms.begin(), stats.handshake_ms.end());
+    std::sort(stats.ttfb_ms.begin(), stats.ttfb_ms.end());
+    cout << "tunnels:   " << stats.ok << " ok, " << stats.failed << " failed in " << seconds << " s ("
+         << (stats.ok + stats.failed) / seconds << " conn/s)\n"
+         << "commands:  connect " << stats.by_command[0] << ", bind " << stats.by_command[1]
+         << ", socks4a " << stats.by_command[2] << "\n"
+         << "handshake: p50 " << percentile(stats.handshake_ms, 50) << " ms, p90 "
+         << percentile(stats.handshake_ms, 90) << " ms, p99 " << percentile(stats.handshake_ms, 99)
+         << " ms, max " << percentile(stats.handshake_ms, 100) << " ms\n";
+    if (options.payload)
+        cout << "ttfb:      p50 " << percentile(stats.ttfb_ms, 50) << " ms, p90 "
+             << percentile(stats.ttfb_ms, 90) << " ms, p99 " << percentile(stats.ttfb_ms, 99)
+             << " ms, max " << percentile(stats.ttfb_ms, 100) << " ms\n"
+             << "relay:     " << stats.bytes * 2 / 1e6 << " MB echoed, " << stats.bytes * 2 / 1e6 / seconds << " MB/s\n";
+}
+
+//socks4_parser on a mix of SOCKS4 and SOCKS4a requests, each parsed whole
+//and as it would arrive in reads of 3 bytes, re-parsed after every read
+void parse_bench()
+{
+    const std::vector<std::vector<u_char>> requests = {
+        socks4_request(socks4_connect, "140.113.1.2", 80),
+        socks4_request(socks4_connect, "140.113.1.2", 80, "user"),
+        socks4_request(socks4_bind, "10.0.0.1", 21, "ftp"),
+        socks4_request(socks4_connect, "www.example.com", 443, "user")};
+    for (std::size_t step : {std::size_t(0), std::size_t(3)})
+    {
+        uint64_t parses = 0, calls = 0;
+        //keeps the results, and so the parsing, from being optimized away
+        volatile std::size_t sink = 0;
+        auto started = std::chrono::steady_clock::now();
+        for (unsigned round = 0; round < options.parse_rounds; round++)
+            for (const auto &request : requests)
+            {
+                socks4_parser parser;
+                socks4_parsed parsed;
+                std::size_t length = step ? std::min(step, request.size()) : request.size();
+                while (true)
+                {
+                    calls++;
+                    if (parser.parse(request.data(), length, parsed) != socks4_incomplete || length == request.size())
+                        break;
+                    length = std::min(length + step, request.size());
+                }
+                sink = sink + parsed.port + parsed.domain.size();
+                parses++;
+            }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        cout << "parse:     " << (step ? "3-byte reads " : "whole        ") << parses / seconds / 1e6 << " M requests/s, "
+             << seconds * 1e9 / parses << " ns per request, " << calls << " calls\n";
+    }
+}
+
+//random "permit c" rules, a wildcard in each octet with probability 1/4, so
+//15 of the 16 masks occur (*.*.*.* would permit everything); lookups are
+//half addresses a rule was made from, half random ones
+void firewall_bench()
+{
+    std::mt19937 rng(1);
+    for (unsigned count : {10u, 1000u, 100000u})
+    {
+        std::ostringstream conf;
+        std::vector<uint32_t> ruled;
+        for (unsigned i = 0; i < count; i++)
+        {
+            uint32_t addr = rng();
+            unsigned wildcards;
+            do
+            {
+                wildcards = 0;
+                for (int octet = 0; octet < 4; octet++)
+                    wildcards |= (rng() % 4 == 0) << octet;
+            } while (wildcards == 15);
+            ruled.push_back(addr);
+            conf << "permit c";
+            for (int octet = 3; octet >= 0; octet--)
+            {
+                conf << (octet == 3 ? " " : ".");
+                if (wildcards >> octet & 1)
+                    conf << "*";
+                else
+                    conf << (addr >> octet * 8 & 0xff);
+            }
+            conf << "\n";
+        }
+        std::istringstream in(conf.str());
+        auto rules = firewall_rules::load(in, "firewall bench");
+
+        std::vector<uint32_t> lookups(options.firewall_lookups);
+        for (auto &addr : lookups)
+            addr = rng() % 2 ? ruled[rng() % ruled.size()] : rng();
+        uint64_t permitted = 0;
+        auto started = std::chrono::steady_clock::now();
+        for (uint32_t addr : lookups)
+            permitted += rules->permit(1, addr);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        cout << "firewall:  " << count << " rules, " << seconds * 1e9 / lookups.size() << " ns per match, "
+             << permitted * 100.0 / lookups.size() << "% permitted\n";
+    }
+}
+
+//admission with every limit set but none reached, N tunnels held from N
+//client addresses: admitting them, then admit+release cycles over the same
+//clients on -t threads, and the shared bandwidth bucket a relay read charges
+void admission_bench()
+{
+    const unsigned n = options.admission_clients;
+    admission::limits limits;
+    limits.max_tunnels = 10 * n;
+    limits.max_per_client = 1000;
+    limits.max_connect_rate = 1000000000;
+    limits.client_bandwidth = 1000000000000ull;
+    std::unique_ptr<admission> control(new admission);
+    control->configure(limits);
+    auto client = [](unsigned i) { return boost::asio::ip::address(boost::asio::ip::address_v4(0x0a000000 + i)); };
+    auto ns_since = [](std::chrono::steady_clock::time_point started, double count) {
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count() / count;
+    };
+
+    std::vector<shared_ptr<admission::ticket>> held;
+    held.reserve(n);
+    auto started = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < n; i++)
+        held.push_back(control->admit(client(i)));
+    cout << "admission: admit " << ns_since(started, n) << " ns, " << n << " clients\n";
+
+    const unsigned cycles = 10 * n;
+    started = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < options.threads; t++)
+        threads.emplace_back([&, t] {
+            for (unsigned i = t; i < cycles; i += options.threads)
+                control->admit(client(i % n)).reset();
+        });
+    for (auto &t : threads)
+        t.join();
+    cout << "admission: admit+release " << ns_since(started, cycles) << " ns with " << n << " held, "
+         << options.threads << " threads\n";
+
+    rate_limiter bucket;
+    bucket.configure(limits.client_bandwidth, admission::bandwidth_burst);
+    int64_t now = rate_limiter::now();
+    started = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < cycles; i++)
+        bucket.take(16384, now);
+    cout << "admission: bandwidth bucket take " << ns_since(started, cycles) << " ns\n";
+}
+
+//N idle timeouts as the server keeps them, on the timing wheel and as one
+//steady_timer with a pending async_wait each: arming them, pushing every
+//deadline later as each relayed chunk does, cancelling, and heap per timer
+void timer_bench()
+{
+    const std::size_t n = options.timer_count;
+    const auto later = std::chrono::seconds(300);
+    auto ns_since = [n](std::chrono::steady_clock::time_point started) {
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count() / n;
+    };
+    auto heap = [] { return mallinfo2().uordblks; };
+    {
+        boost::asio::io_context io_context;
+        timing_wheel wheel(io_context);
+        std::vector<std::unique_ptr<timing_wheel::timer>> timers;
+        timers.reserve(n);
+        std::size_t heap_before = heap();
+        for (std::size_t i = 0; i < n; i++)
+            timers.emplace_back(new timing_wheel::timer([] {}));
+        std::size_t bytes = (heap() - heap_before) / n;
+        auto started = std::chrono::steady_clock::now();
+        for (auto &t : timers)
+            t->expires_after(wheel, later);
+        double arm = ns_since(started);
+        started = std::chrono::steady_clock::now();
+        for (auto &t : timers)
+            t->expires_after(wheel, later + std::chrono::seconds(1));
+        double rearm = ns_since(started);
+        //none is due, the wheel only ticks
+        std::size_t handlers = io_context.run_for(std::chrono::seconds(1));
+        started = std::chrono::steady_clock::now();
+        for (auto &t : timers)
+            t->cancel();
+        cout << "timers:    wheel, " << n << " timers: arm " << arm << " ns, re-arm later " << rearm << " ns, cancel "
+             << ns_since(started) << " ns, " << bytes << " B each, " << handlers << " handlers in 1 s\n";
+    }
+    {
+        boost::asio::io_context io_context;
+        std::vector<std::unique_ptr<boost::asio::steady_timer>> timers;
+        timers.reserve(n);
+        std::size_t heap_before = heap();
+        for (std::size_t i = 0; i < n; i++)
+            timers.emplace_back(new boost::asio::steady_timer(io_context));
+        std::size_t bytes = (heap() - heap_before) / n;
+        auto started = std::chrono::steady_clock::now();
+        heap_before = heap();
+        for (auto &t : timers)
+        {
+            t->expires_after(later);
+            t->async_wait([](boost::system::error_code) {});
+        }
+        double arm = ns_since(started);
+        std::size_t wait_bytes = (heap() - heap_before) / n;
+        //a later deadline cancels the pending wait, whose handler must run
+        started = std::chrono::steady_clock::now();
+        for (auto &t : timers)
+        {
+            t->expires_after(later + std::chrono::seconds(1));
+            t->async_wait([](boost::system::error_code) {});
+        }
+        io_context.poll();
+        double rearm = ns_since(started);
+        started = std::chrono::steady_clock::now();
+        for (auto &t : timers)
+            t->cancel();
+        io_context.poll();
+        cout << "timers:    steady_timer, " << n << " timers: arm " << arm << " ns, re-arm later " << rearm
+             << " ns, cancel " << ns_since(started) << " ns, " << bytes << " B each + " << wait_bytes
+             << " B per pending wait\n";
+    }
+}
+
+//--wwr: a client that sends a request in two writes, 200 us apart, and waits
+//for the answer. the proxy relays the first half at once; if its upstream
+//socket then holds the second half back (Nagle) until the first is acked,
+//and the server delays that ack until it can answer, a round takes a
+//delayed-ack timeout instead of a round trip
+void wwr_bench(const tcp::endpoint &proxy)
+{
+    boost::asio::io_context io_context;
+    request_server server(io_context);
+    std::thread thread([&io_context] { io_context.run(); });
+
+    boost::asio::io_context client_context;
+    tcp::socket socket(client_context);
+    socket.connect(proxy);
+    auto request = socks4_request(socks4_connect, server.endpoint().address().to_string(), server.endpoint().port());
+    boost::asio::write(socket, boost::asio::buffer(request));
+    std::array<u_char, socks4_reply_length> reply;
+    boost::system::error_code ec;
+    std::size_t length = boost::asio::read(socket, boost::asio::buffer(reply), ec);
+    if (ec || !parse_socks4_reply(reply.data(), length).granted())
+    {
+        cout << "wwr:       tunnel refused\n";
+        io_context.stop();
+        thread.join();
+        return;
+    }
+    socket.set_option(tcp::no_delay(true));
+
+    std::vector<char> half(request_server::request_length / 2, 'x');
+    std::array<char, request_server::response_length> response;
+    std::vector<double> rounds_ms;
+    for (unsigned i = 0; i < options.wwr_rounds; i++)
+    {
+        auto started = std::chrono::steady_clock::now();
+        boost::asio::write(socket, boost::asio::buffer(half));
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+        boost::asio::write(socket, boost::asio::buffer(half));
+        boost::asio::read(socket, boost::asio::buffer(response));
+        rounds_ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count());
+    }
+    socket.close();
+    io_context.stop();
+    thread.join();
+    std::sort(rounds_ms.begin(), rounds_ms.end());
+    cout << "wwr:       " << rounds_ms.size() << " rounds, p50 " << percentile(rounds_ms, 50) << " ms, p99 "
+         << percentile(rounds_ms, 99) << " ms, max " << percentile(rounds_ms, 100) << " ms\n";
+}
+
+void usage()
+{
+    cerr << "Usage: socks_bench [options]\n"
+         << "  -s, --server H:P   socks_server to load (default: 127.0.0.1:1080)\n"
+         << "  -c, --concurrency N  tunnels open at the same time (default: 100)\n"
+         << "  -n, --tunnels N    total tunnels (default: 10000)\n"
+         << "  -p, --payload B    bytes echoed through each tunnel (default: 0)\n"
+         << "  -b, --bind PCT     percentage of BIND requests (default: 0)\n"
+         << "  -a, --socks4a PCT  percentage of SOCKS4a requests for \"localhost\" (default: 0)\n"
+         << "  -t, --threads N    client threads (default: 1)\n"
+         << "  --echo-port P      port of the bundled echo server (default: any)\n"
+         << "  --accept-delay MS  echo server waits MS before serving a new connection\n"
+         << "  --hold S           keep every tunnel open S seconds after its payload\n"
+         << "  -u, --udp S        SOCKS5 UDP ASSOCIATE mode: -c flows echo -p byte datagrams\n"
+         << "                     (default 64) for S seconds and report packets per second\n"
+         << "  --udp-window N     datagrams in flight per flow (default: 8)\n"
+         << "  --parse N          no server: time N rounds of the SOCKS4 request parser\n"
+         << "  --firewall N       no server: time N permit lookups against 10, 1k and 100k random rules\n"
+         << "  --timers N         no server: time N timers on the timing wheel and as steady_timers\n"
+         << "  --admission N      no server: time admission control with N tunnels held from N clients\n"
+         << "  --wwr N            N rounds of two 100 byte writes and a read through a single tunnel,\n"
+         << "                     report the round time\n"
+         << "  --bulk N           send N MiB one way through a single tunnel to a discard server\n"
+         << "                     and report MB/s\n";
+}
+
+enum
+{
+    opt_echo_port = 256,
+    opt_accept_delay,
+    opt_udp_window,
+    opt_parse,
+    opt_firewall,
+    opt_bulk,
+    opt_hold,
+    opt_admission,
+    opt_timers,
+    opt_wwr
+};
+
+bool parse_options(int argc, char *argv[])
+{
+    static const struct option long_opts[] = {
+        {"server", required_argument, nullptr, 's'},
+        {"concurrency", required_argument, nullptr, 'c'},
+        {"tunnels", required_argument, nullptr, 'n'},
+        {"payload", required_argument, nullptr, 'p'},
+        {"bind", required_argument, nullptr, 'b'},
+        {"socks4a", required_argument, nullptr, 'a'},
+        {"threads", required_argument, nullptr, 't'},
+        {"echo-port", required_argument, nullptr, opt_echo_port},
+        {"accept-delay", required_argument, nullptr, opt_accept_delay},
+        {"udp", required_argument, nullptr, 'u'},
+        {"udp-window", required_argument, nullptr, opt_udp_window},
+        {"parse", required_argument, nullptr, opt_parse},
+        {"firewall", required_argument, nullptr, opt_firewall},
+        {"bulk", required_argument, nullptr, opt_bulk},
+        {"hold", required_argument, nullptr, opt_hold},
+        {"admission", required_argument, nullptr, opt_admission},
+        {"timers", required_argument, nullptr, opt_timers},
+        {"wwr", required_argument, nullptr, opt_wwr},
+        {nullptr, 0, nullptr, 0}};
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:c:n:p:b:a:t:u:", long_opts, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+        {
+            string server = optarg;
+            std::size_t colon = server.rfind(':');
+            if (colon == string::npos)
+                return false;
+            options.socks_host = server.substr(0, colon);
+            options.socks_port = std::atoi(server.c_str() + colon + 1);
+            break;
+        }
+        case 'c':
+            options.concurrency = std::max(1, std::atoi(optarg));
+            break;
+        case 'n':
+            options.tunnels = std::max(1, std::atoi(optarg));
+            break;
+        case 'p':
+            options.payload = std::atoll(optarg);
+            break;
+        case 'b':
+            options.bind_percent = std::atoi(optarg);
+            break;
+        case 'a':
+            options.socks4a_percent = std::atoi(optarg);
+            break;
+        case 't':
+            options.threads = std::max(1, std::atoi(optarg));
+            break;
+        case opt_echo_port:
+            options.echo_port = std::atoi(optarg);
+            break;
+        case opt_accept_delay:
+            options.accept_delay = std::chrono::milliseconds(std::atoi(optarg));
+            break;
+        case 'u':
+            options.udp_seconds = std::max(1, std::atoi(optarg));
+            break;
+        case opt_udp_window:
+            options.udp_window = std::max(1, std::atoi(optarg));
+            break;
+        case opt_parse:
+            options.parse_rounds = std::max(1, std::atoi(optarg));
+            break;
+        case opt_firewall:
+            options.firewall_lookups = std::max(1, std::atoi(optarg));
+            break;
+        case opt_bulk:
+            options.bulk_mib = std::max(1, std::atoi(optarg));
+            break;
+        case opt_hold:
+            options.hold = std::chrono::seconds(std::atoi(optarg));
+            break;
+        case opt_admission:
+            options.admission_clients = std::max(1, std::atoi(optarg));
+            break;
+        case opt_timers:
+            options.timer_count = std::max(1, std::atoi(optarg));
+            break;
+        case opt_wwr:
+            options.wwr_rounds = std::max(1, std::atoi(optarg));
+            break;
+        default:
+            return false;
+        }
+    }
+    return optind == argc && options.bind_percent + options.socks4a_percent <= 100;
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        if (!parse_options(argc, argv))
+        {
+            usage();
+            return 1;
+        }
+        if (options.parse_rounds)
+        {
+            parse_bench();
+            return 0;
+        }
+        if (options.firewall_lookups)
+        {
+            firewall_bench();
+            return 0;
+        }
+        if (options.admission_clients)
+        {
+            admission_bench();
+            return 0;
+        }
+        if (options.timer_count)
+        {
+            timer_bench();
+            return 0;
+        }
+        boost::asio::io_context io_context;
+        echo_server echo(io_context);
+        tcp::resolver resolver(io_context);
+        tcp::endpoint proxy = *resolver.resolve(tcp::v4(), options.socks_host, std::to_string(options.socks_port)).begin();
+
+        if (options.wwr_rounds)
+        {
+            wwr_bench(proxy);
+            return 0;
+        }
+        if (options.bulk_mib)
+        {
+            discard_server sink(io_context);
+            auto transfer = std::make_shared<bulk_transfer>(io_context, proxy, sink.endpoint());
+            transfer->start();
+            io_context.run();
+            uint64_t bytes = uint64_t(options.bulk_mib) << 20;
+            if (!transfer->done() || sink.received() != bytes)
+            {
+                cout << "bulk:      failed, " << sink.received() << " of " << bytes << " bytes arrived\n";
+                return 1;
+            }
+            cout << "bulk:      " << options.bulk_mib << " MiB in " << transfer->seconds() << " s ("
+                 << bytes / 1e6 / transfer->seconds() << " MB/s)\n";
+            return 0;
+        }
+
+        if (options.udp_seconds)
+        {
+            udp_echo_server udp_echo(io_context);
+            std::vector<shared_ptr<bench_flow>> flows;
+            for (unsigned i = 0; i < options.concurrency; i++)
+            {
+                flows.push_back(std::make_shared<bench_flow>(io_context, proxy, udp_echo.endpoint()));
+                flows.back()->start();
+            }
+            //the clock starts once the associations are set up
+            io_context.run_for(std::chrono::milliseconds(500));
+            for (auto &f : flows)
+                stats.datagrams -= f->received();
+            auto started = std::chrono::steady_clock::now();
+            std::clock_t cpu_started = std::clock();
+            io_context.run_for(std::chrono::seconds(options.udp_seconds));
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+            double cpu_seconds = double(std::clock() - cpu_started) / CLOCKS_PER_SEC;
+            for (auto &f : flows)
+            {
+                stats.datagrams += f->received();
+                (f->received() ? stats.ok : stats.failed)++;
+                f->stop();
+            }
+            flows.clear();
+            report_udp(seconds, cpu_seconds);
+            return 0;
+        }
+
+        load_generator generator(io_context, proxy, echo.endpoint());
+        auto started = std::chrono::steady_clock::now();
+        generator.start();
+        std::vector<std::thread> threads;
+        for (unsigned i = 1; i < options.threads; i++)
+            threads.emplace_back([&io_context] { io_context.run(); });
+        io_context.run();
+        for (auto &t : threads)
+            t.join();
+        report(std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "Exception: " << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
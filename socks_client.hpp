@@ -0,0 +1,109 @@
+#ifndef SOCKS_CLIENT_HPP
+#define SOCKS_CLIENT_HPP
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+
+//client side of the SOCKS4/4a handshake, shared by the console CGI and socks_bench,
+//plus the SOCKS5 UDP ASSOCIATE pieces socks_bench uses
+
+enum
+{
+    socks4_connect = 1,
+    socks4_bind = 2,
+    socks4_granted = 90,
+    socks4_rejected = 91,
+    socks4_reply_length = 8,
+
+    socks5_udp_associate = 3,
+    //a reply or UDP header with an IPv4 address
+    socks5_ipv4_reply_length = 10,
+    socks5_ipv4_udp_header = 10
+};
+
+//a dotted IPv4 host is sent as is, anything else as a SOCKS4a domain
+inline std::vector<u_char> socks4_request(u_char cd, const std::string &host, unsigned short port,
+                                          const std::string &user_id = "")
+{
+    std::vector<u_char> request = {4, cd, (u_char)(port / 256), (u_char)(port % 256)};
+    boost::system::error_code ec;
+    auto addr = boost::asio::ip::make_address_v4(host, ec);
+    if (!ec)
+    {
+        auto bytes = addr.to_bytes();
+        request.insert(request.end(), bytes.begin(), bytes.end());
+    }
+    else
+    {
+        u_char socks4a[] = {0, 0, 0, 1};
+        request.insert(request.end(), socks4a, socks4a + 4);
+    }
+    request.insert(request.end(), user_id.begin(), user_id.end());
+    request.push_back(0);
+    if (ec)
+    {
+        request.insert(request.end(), host.begin(), host.end());
+        request.push_back(0);
+    }
+    return request;
+}
+
+struct socks4_reply
+{
+    bool valid = false;
+    u_char code = 0;
+    unsigned short port = 0;
+    boost::asio::ip::address_v4 addr;
+
+    bool granted() const { return valid && code == socks4_granted; }
+};
+
+inline socks4_reply parse_socks4_reply(const void *data, std::size_t length)
+{
+    const u_char *p = static_cast<const u_char *>(data);
+    socks4_reply reply;
+    if (length != socks4_reply_length || p[0] != 0)
+        return reply;
+    reply.valid = true;
+    reply.code = p[1];
+    reply.port = p[2] << 8 | p[3];
+    boost::asio::ip::address_v4::bytes_type ip = {{p[4], p[5], p[6], p[7]}};
+    reply.addr = boost::asio::ip::address_v4(ip);
+    return reply;
+}
+
+//greeting offering no authentication, pipelined with the request; the
+//address is IPv4 only, which is all socks_bench needs
+inline std::vector<u_char> socks5_request(u_char cd, const boost::asio::ip::address_v4 &addr, unsigned short port)
+{
+    auto bytes = addr.to_bytes();
+    std::vector<u_char> request = {5, 1, 0, 5, cd, 0, 1};
+    request.insert(request.end(), bytes.begin(), bytes.end());
+    request.push_back(port / 256);
+    request.push_back(port % 256);
+    return request;
+}
+
+//the method selection followed by the reply, both as sent by the server
+inline bool parse_socks5_reply(const u_char *p, std::size_t length, boost::asio::ip::udp::endpoint &bound)
+{
+    if (length != 2 + socks5_ipv4_reply_length || p[0] != 5 || p[1] != 0 || p[2] != 5 || p[3] != 0 || p[5] != 1)
+        return false;
+    boost::asio::ip::address_v4::bytes_type ip = {{p[6], p[7], p[8], p[9]}};
+    bound = boost::asio::ip::udp::endpoint(boost::asio::ip::address_v4(ip), p[10] << 8 | p[11]);
+    return true;
+}
+
+inline void socks5_udp_header(u_char *p, const boost::asio::ip::udp::endpoint &to)
+{
+    auto bytes = to.address().to_v4().to_bytes();
+    p[0] = p[1] = p[2] = 0;
+    p[3] = 1;
+    std::copy(bytes.begin(), bytes.end(), p + 4);
+    p[8] = to.port() / 256;
+    p[9] = to.port() % 256;
+}
+
+#endif
@@ -1,14 +1,49 @@
 #include <stdlib.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sched.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/filter.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <memory>
 #include <utility>
+#include <thread>
 #include <boost/asio.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/utility/string_view.hpp>
+#include "socks4_parser.hpp"
+#include "firewall_rules.hpp"
+#include "admission.hpp"
+#include "timing_wheel.hpp"
 #include <vector>
 #include <array>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <numeric>
+#include <cstring>
+#include <type_traits>
+#include <tuple>
 
 using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
 using std::cerr;
 using std::cout;
 using std::endl;
@@ -17,297 +52,4745 @@ using std::string;
 
 enum
 {
-    max_length = 8192
+    max_request_length = 1024
 };
-boost::asio::io_context io_context;
 
-class session
-    : public std::enable_shared_from_this<session>
+typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+
+struct server_options
 {
-public:
-    session(std::shared_ptr<tcp::socket> read_sock, std::shared_ptr<tcp::socket> send_sock)
-        : read_sock_(read_sock), send_sock_(send_sock) {}
-    void start()
-    {
-        do_read();
-    }
+    unsigned short port = 0;
+    //event loop threads, each owns an io_context and a SO_REUSEPORT acceptor
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    //legacy mode: single loop, fork() for every accepted client
+    bool fork_mode = false;
+    //firewall rules, reloaded on SIGHUP
+    string config_path = "socks_conf";
+    //relay with splice() through a pipe instead of a user space buffer
+    bool splice = false;
+    //accept and relay through io_uring, where the kernel supports it
+    bool io_uring = false;
+    unsigned uring_buffers = 512;
+    //hot restart: Unix socket to take over listeners on and hand them on from
+    string handoff_path;
+    std::chrono::seconds drain_timeout{30};
+    //prometheus text endpoint, 0 = disabled
+    unsigned short metrics_port = 0;
+    //access log file, "-" = stdout, "off" = disabled
+    string access_log_path = "-";
+    bool access_log_jsonl = false;
 
-private:
-    shared_ptr<tcp::socket> read_sock_;
-    shared_ptr<tcp::socket> send_sock_;
-    std::array<unsigned char, max_length> relay_data = {0};
+    //per-phase handshake deadlines: request and name lookup, connect, BIND
+    //waiting for its peer; then the relay's idle timeout, 0 = none
+    std::chrono::seconds handshake_timeout{10};
+    std::chrono::seconds connect_timeout{10};
+    std::chrono::seconds bind_timeout{120};
+    std::chrono::seconds idle_timeout{0};
 
-    void do_read()
-    {
-        auto self(shared_from_this());
-        read_sock_->async_read_some(boost::asio::buffer(relay_data, max_length),
-                                    [this, self](boost::system::error_code ec, std::size_t length) {
-                                        if (!ec)
-                                        {
-                                            do_write(length);
-                                        }
-                                        else
-                                        {
-                                            cout << "read error: " << ec.message() << endl;
-                                            read_sock_->close();
-                                            send_sock_->close();
-                                        }
-                                    });
-    }
+    //SOCKS4a resolution cache
+    std::chrono::seconds dns_ttl{60};
+    std::chrono::seconds dns_negative_ttl{10};
+    std::size_t dns_cache_size = 4096;
 
-    void do_write(std::size_t length)
+    //delay between happy eyeballs connect attempts
+    std::chrono::milliseconds connect_stagger{250};
+    //hot destinations kept pre-connected, per event loop
+    std::vector<tcp::endpoint> prewarm;
+    unsigned prewarm_size = 2;
+    //idle connections per parent proxy and thread
+    unsigned parent_pool_size = 2;
+    //--bind-ports, 0 = an ephemeral listener per BIND
+    u_short bind_port_low = 0, bind_port_high = 0;
+
+    //UDP ASSOCIATE: datagrams per recvmmsg/sendmmsg and the flow idle timeout
+    unsigned udp_batch = 32;
+    std::chrono::seconds udp_idle_timeout{60};
+
+    //admission control, 0 = unlimited: concurrent connections in total and
+    //per source address, new connections per second per source address
+    unsigned max_tunnels = 0;
+    unsigned max_per_client = 0;
+    unsigned max_connect_rate = 0;
+    //relay shaping in bytes/s per direction, for each tunnel and for all
+    //tunnels of one source address
+    uint64_t tunnel_bandwidth = 0;
+    uint64_t client_bandwidth = 0;
+    //TCP_FASTOPEN queue length of the listeners, 0 = off
+    int tcp_fastopen = 0;
+    //--top-tunnels: file or unix:SOCKET the busiest tunnels are exported to
+    //every top_interval, empty = no tunnel table
+    string top_path;
+    std::chrono::seconds top_interval{5};
+    unsigned top_count = 20;
+    unsigned tunnel_slots = 4096;
+    //--cpu-affinity: event loop i runs on cpus[i % size], empty = not pinned
+    std::vector<int> cpus;
+};
+server_options options;
+
+//current rule set, swapped atomically on reload so sessions never see a partial one
+shared_ptr<const firewall_rules> firewall_;
+
+void load_firewall()
+{
+    auto rules = firewall_rules::load(options.config_path);
+    if (!rules)
     {
-        auto self(shared_from_this());
-        boost::asio::async_write(*send_sock_, boost::asio::buffer(relay_data, length),
-                                 [this, self](boost::system::error_code ec, std::size_t write_length) {
-                                     if (!ec)
-                                     {
-                                         do_read();
-                                     }
-                                     else
-                                     {
-                                         cout << "write error: " << ec.message() << endl;
-                                         read_sock_->close();
-                                         send_sock_->close();
-                                     }
-                                 });
+        cerr << options.config_path << " not exist" << endl;
+        if (std::atomic_load(&firewall_))
+            return;
+        rules = std::make_shared<firewall_rules>();
     }
-};
-class socks_sess
-    : public std::enable_shared_from_this<socks_sess>
+    std::atomic_store(&firewall_, rules);
+}
+
+//SOCKS4a name cache shared by all event loops. concurrent lookups of one name
+//wait on a single query, failures are cached too. getaddrinfo does not report
+//record TTLs, so entries expire after the configured --dns-ttl and
+//--dns-negative-ttl instead.
+class dns_cache
 {
 public:
-    socks_sess(std::shared_ptr<tcp::socket> sock)
-        :cli_socket(sock){}
+    typedef std::vector<boost::asio::ip::address> addresses;
+    typedef std::function<void(boost::system::error_code, const addresses &)> handler;
+    typedef tcp::socket::executor_type executor;
 
-    void start(){
-        socks_read();
-    }
+    std::atomic<uint64_t> hits{0}, misses{0}, coalesced{0};
 
-private:
-    shared_ptr<tcp::socket> cli_socket;
-    shared_ptr<tcp::socket> dst_socket = std::make_shared<tcp::socket> (io_context);
-    u_char data_[max_length] = {0};
+    //the handler is always invoked through ex, never inline
+    void resolve(const string &name, executor ex, handler h)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto it = entries_.find(name);
+        if (it != entries_.end() && it->second.expires > std::chrono::steady_clock::now())
+        {
+            hits.fetch_add(1, std::memory_order_relaxed);
+            lru_.splice(lru_.begin(), lru_, it->second.lru);
+            auto ec = it->second.ec;
+            auto addrs = it->second.addrs;
+            lock.unlock();
+            boost::asio::post(ex, [h, ec, addrs] { h(ec, addrs); });
+            return;
+        }
+        auto &waiters = pending_[name];
+        waiters.emplace_back(ex, std::move(h));
+        if (waiters.size() > 1)
+        {
+            coalesced.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        misses.fetch_add(1, std::memory_order_relaxed);
+        lock.unlock();
 
-    void socks_read(){
-        auto self(shared_from_this());
-        cli_socket->async_read_some(boost::asio::buffer(data_, max_length),
-            [this, self](boost::system::error_code ec, std::size_t length){
-                if(!ec)
-                    socks_protocol(data_);
+        auto resolver = std::make_shared<tcp::resolver>(ex);
+        resolver->async_resolve(name, "0",
+            [this, name, resolver](boost::system::error_code ec, tcp::resolver::results_type results) {
+                addresses addrs;
+                for (const auto &entry : results)
+                    if (std::find(addrs.begin(), addrs.end(), entry.endpoint().address()) == addrs.end())
+                        addrs.push_back(entry.endpoint().address());
+                if (!ec && addrs.empty())
+                    ec = boost::asio::error::host_not_found;
+                complete(name, ec, addrs);
             });
     }
-    void socks_reply(u_char *reply){
-        auto self(shared_from_this());
-        cli_socket->async_send(boost::asio::buffer(reply, 8),
-            [this, self](boost::system::error_code ec, std::size_t write_len){
-                if(ec)
-                    cout << "write error " << endl;
-            });
+
+    std::size_t size()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return entries_.size();
     }
 
-    bool firewall(u_char request[])
+private:
+    struct entry
+    {
+        addresses addrs;
+        boost::system::error_code ec;
+        std::chrono::steady_clock::time_point expires;
+        std::list<string>::iterator lru;
+    };
+    std::mutex mutex_;
+    std::unordered_map<string, entry> entries_;
+    std::list<string> lru_;
+    std::unordered_map<string, std::vector<std::pair<executor, handler>>> pending_;
+
+    void complete(const string &name, boost::system::error_code ec, const addresses &addrs)
     {
-        std::ifstream conf("socks_conf");
-        if (!conf.is_open())
+        std::vector<std::pair<executor, handler>> waiters;
         {
-            cerr << "socks_conf not exist" << endl;
-            return false;
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto ttl = ec ? options.dns_negative_ttl : options.dns_ttl;
+            auto it = entries_.find(name);
+            if (it == entries_.end())
+            {
+                lru_.push_front(name);
+                it = entries_.emplace(name, entry()).first;
+                it->second.lru = lru_.begin();
+            }
+            else
+                lru_.splice(lru_.begin(), lru_, it->second.lru);
+            it->second.addrs = addrs;
+            it->second.ec = ec;
+            it->second.expires = std::chrono::steady_clock::now() + ttl;
+            while (entries_.size() > options.dns_cache_size)
+            {
+                entries_.erase(lru_.back());
+                lru_.pop_back();
+            }
+            waiters.swap(pending_[name]);
+            pending_.erase(name);
         }
-        string rule, mode, addr;
-        string addr_seg[4];
+        for (auto &w : waiters)
+        {
+            auto h = std::move(w.second);
+            boost::asio::post(w.first, [h, ec, addrs] { h(ec, addrs); });
+        }
+    }
+};
+dns_cache dns;
 
-        while (conf >> rule)
+//one record per client connection, written when the tunnel (or the failed
+//handshake) ends
+struct access_record
+{
+    enum verdict_type
+    {
+        verdict_none,
+        verdict_accept,
+        verdict_reject
+    };
+    std::chrono::system_clock::time_point start;
+    std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::duration duration{};
+    tcp::endpoint src, dst;
+    u_char command = 0;
+    u_char verdict = verdict_none;
+    uint64_t bytes[2] = {0, 0};
+    //where the connection failed, if it did
+    const char *stage = nullptr;
+    boost::system::error_code error;
+};
+
+//bounded lock-free multi-producer queue (Vyukov). producers never block, a
+//full ring makes try_push fail and the caller drops the item.
+template <typename T>
+class mpsc_ring
+{
+public:
+    explicit mpsc_ring(std::size_t capacity)
+        : mask_(capacity - 1), cells_(new cell[capacity])
+    {
+        for (std::size_t i = 0; i < capacity; i++)
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+    bool try_push(const T &value)
+    {
+        std::size_t pos = enqueue_.load(std::memory_order_relaxed);
+        for (;;)
         {
-            conf >> mode;
-            conf >> addr;
-            std::size_t pos;
-            for (int i = 0; i < 4; i++)
+            cell &c = cells_[pos & mask_];
+            std::size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if (dif == 0)
             {
-                pos = addr.find('.');
-                if (pos != string::npos)
+                if (enqueue_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
                 {
-                    addr_seg[i] = addr.substr(0, pos);
-                    addr.erase(0, pos + 1);
-                }
-                else
-                    addr_seg[i] = addr.substr(0);
-            }
-            if ((mode == "c" && request[1] == 1) || (mode == "b" && request[1] == 2))
-            {
-                bool same_addr = true;
-                for (int i = 0; i < 4; i++)
-                    if (addr_seg[i] != "*" && ((u_char)std::stoul(addr_seg[i]) != request[i + 4]))
-                    {
-                        same_addr = false;
-                        break;
-                    }
-                if (same_addr)
+                    c.data = value;
+                    c.seq.store(pos + 1, std::memory_order_release);
                     return true;
+                }
             }
+            else if (dif < 0)
+                return false;
+            else
+                pos = enqueue_.load(std::memory_order_relaxed);
         }
-        return false;
     }
+    //single consumer
+    bool try_pop(T &value)
+    {
+        cell &c = cells_[dequeue_ & mask_];
+        std::size_t seq = c.seq.load(std::memory_order_acquire);
+        if ((intptr_t)seq - (intptr_t)(dequeue_ + 1) < 0)
+            return false;
+        value = c.data;
+        c.seq.store(dequeue_ + mask_ + 1, std::memory_order_release);
+        dequeue_++;
+        return true;
+    }
+
+private:
+    struct cell
+    {
+        std::atomic<std::size_t> seq;
+        T data;
+    };
+    const std::size_t mask_;
+    std::unique_ptr<cell[]> cells_;
+    //keep producer and consumer positions on separate cache lines
+    char pad0_[64];
+    std::atomic<std::size_t> enqueue_{0};
+    char pad1_[64];
+    std::size_t dequeue_ = 0;
+};
 
-    void socks_protocol(u_char request_[])
+//structured access log. event loops push records into a ring, a background
+//thread formats them in batches and writes each batch with one write().
+class access_logger
+{
+public:
+    enum format_type
+    {
+        format_text,
+        format_jsonl
+    };
+    enum
     {
-        tcp::endpoint ep;
-        //u_char request_[max_length] = {0};
-        u_char reply_[8] = {0};
+        ring_capacity = 1 << 14,
+        max_batch = 256,
+        idle_wait_ms = 10
+    };
 
-        //cli_socket->read_some(boost::asio::buffer(request_));
-        u_char vn = request_[0];
-        u_char cd = request_[1];
-        u_short dst_port = request_[2] << 8 | request_[3];
-        string dst_ip = std::to_string(request_[4]) + "." + std::to_string(request_[5]) + "." + std::to_string(request_[6]) + "." + std::to_string(request_[7]);
-        string usr_id = (char *)(request_ + 8);
+    std::atomic<uint64_t> dropped{0};
 
-        cout << dst_port << endl;
-        if (vn != 4)
+    ~access_logger() { close(); }
+
+    bool open(const string &path, format_type format, bool async)
+    {
+        if (path == "off")
+            return true;
+        if (path == "-")
+            fd_ = dup(STDOUT_FILENO);
+        else
+            fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd_ < 0)
+            return false;
+        format_ = format;
+        if (async)
         {
-            cerr << "Bad socks4 request\n";
-            exit(0);
+            ring_.reset(new mpsc_ring<access_record>(ring_capacity));
+            running_ = true;
+            writer_ = std::thread([this] { run(); });
         }
-        else if (cd != 1 && cd != 2)
+        return true;
+    }
+
+    //stops the writer after it drained the ring
+    void close()
+    {
+        running_ = false;
+        if (writer_.joinable())
+            writer_.join();
+        if (fd_ >= 0)
+            ::close(fd_);
+        fd_ = -1;
+    }
+
+    void write(const access_record &record)
+    {
+        if (fd_ < 0)
+            return;
+        if (!ring_)
         {
-            cerr << "Bad socks4 request CD = " << cd << endl;
+            //fork mode: no writer thread in the children, write in place
+            string line;
+            format(record, line);
+            write_all(line);
         }
-        //socks4A
-        if (request_[4] == 0 && request_[5] == 0 && request_[6] == 0 && request_[7] != 0)
+        else if (!ring_->try_push(record))
+            dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static string endpoint_string(const tcp::endpoint &ep)
+    {
+        if (ep.address().is_v6())
+            return "[" + ep.address().to_string() + "]:" + std::to_string(ep.port());
+        return ep.address().to_string() + ":" + std::to_string(ep.port());
+    }
+
+private:
+    int fd_ = -1;
+    format_type format_ = format_text;
+    std::unique_ptr<mpsc_ring<access_record>> ring_;
+    std::atomic<bool> running_{false};
+    std::thread writer_;
+
+    void run()
+    {
+        string batch;
+        access_record record;
+        for (;;)
         {
-            string domain_name = (char *)(request_ + 8) + usr_id.length() + 1;
-            tcp::resolver resolver_(io_context);
-            boost::system::error_code ec;
-            tcp::resolver::iterator ep_iter = resolver_.resolve(domain_name, std::to_string(dst_port), ec);
-            if (!ec)
+            batch.clear();
+            int n = 0;
+            while (n < max_batch && ring_->try_pop(record))
             {
-                for (tcp::resolver::iterator end; ep_iter != end; ep_iter++)
-                {
-                    if (ep_iter->endpoint().address().is_v4())
-                    {
-                        dst_ip = ep_iter->endpoint().address().to_string();
-                        dst_port = ep_iter->endpoint().port();
-                        break;
-                    }
-                }
+                format(record, batch);
+                n++;
             }
+            if (n > 0)
+                write_all(batch);
+            else if (!running_)
+                break;
             else
-            {
-                cerr << "[resolve error]: " << ec.message() << endl;
-                exit(1);
-            }
+                std::this_thread::sleep_for(std::chrono::milliseconds(idle_wait_ms));
         }
-        //firewall check
-        if (!firewall(request_))
+    }
+
+    void write_all(const string &data)
+    {
+        std::size_t done = 0;
+        while (done < data.size())
         {
-            reply_[0] = 0;
-            reply_[1] = 91;
-            //cli_socket->send(boost::asio::buffer(reply_, 8));
-            socks_reply(reply_);
+            ssize_t n = ::write(fd_, data.data() + done, data.size() - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return;
+            done += n;
         }
-        else
+    }
+
+    //a JSON string body: quotes, backslashes and control characters escaped.
+    //error texts come from strerror and may be localized
+    static string json_escape(const string &s)
+    {
+        string out;
+        out.reserve(s.size());
+        for (unsigned char c : s)
         {
-            reply_[0] = 0;
-            reply_[1] = 90;
-        }
-        cout << "<S_IP>: " << cli_socket->remote_endpoint().address().to_string() << endl;
-        cout << "<S_PORT>: " << cli_socket->remote_endpoint().port() << endl;
-        cout << "<D_IP>: " << dst_ip << endl;
-        cout << "<D_PORT>: " << dst_port << endl;
-        cout << "<Commmand>: " << ((cd == 1) ? "Connect" : "Bind") << endl;
-        cout << "<Reply>: " << ((reply_[1] == 91) ? "Reject" : "Accept") << "\n"
-             << endl;
-        if (reply_[1] == 91)
-            exit(0);
-        //Check connect or bind operation
-        //auto dst_socket = std::make_shared<tcp::socket>(io_context);
-        if (cd == 1)
-        {
-            //connect
-            tcp::endpoint ep(boost::asio::ip::address::from_string(dst_ip), dst_port);
-            boost::system::error_code ec;
-            dst_socket->connect(ep, ec);
-            if (!ec)
-                socks_reply(reply_);
-                //cli_socket->send(boost::asio::buffer(reply_, 8));
+            if (c == '"' || c == '\\')
+            {
+                out += '\\';
+                out += c;
+            }
+            else if (c < 0x20)
+            {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            }
             else
+                out += c;
+        }
+        return out;
+    }
+
+    void format(const access_record &r, string &out)
+    {
+        static const char *commands[] = {"-", "connect", "bind", "udp"};
+        static const char *verdicts[] = {"none", "accept", "reject"};
+        char time[32];
+        std::time_t t = std::chrono::system_clock::to_time_t(r.start);
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%SZ", &tm);
+        const char *command = r.command < 4 ? commands[r.command] : "?";
+        double seconds = std::chrono::duration<double>(r.duration).count();
+        string error;
+        if (r.stage)
+            error = string(r.stage) + (r.error ? ": " + r.error.message() : "");
+
+        char line[512];
+        if (format_ == format_jsonl)
+            snprintf(line, sizeof(line),
+                     "{\"time\":\"%s\",\"src\":\"%s\",\"dst\":\"%s\",\"command\":\"%s\",\"verdict\":\"%s\","
+                     "\"bytes_up\":%llu,\"bytes_down\":%llu,\"duration\":%.6f%s%s%s}\n",
+                     time, json_escape(endpoint_string(r.src)).c_str(), json_escape(endpoint_string(r.dst)).c_str(),
+                     command, verdicts[r.verdict], (unsigned long long)r.bytes[0], (unsigned long long)r.bytes[1], seconds,
+                     r.stage ? ",\"error\":\"" : "", json_escape(error).c_str(), r.stage ? "\"" : "");
+        else
+            snprintf(line, sizeof(line), "%s %s %s %s %s up=%llu down=%llu time=%.6f%s%s\n",
+                     time, endpoint_string(r.src).c_str(), endpoint_string(r.dst).c_str(), command, verdicts[r.verdict],
+                     (unsigned long long)r.bytes[0], (unsigned long long)r.bytes[1], seconds,
+                     r.stage ? " error=" : "", error.c_str());
+        out += line;
+    }
+};
+access_logger access_log;
+
+//counts the session, tunnel and UDP association objects of the process. a
+//forked child serves a single client and stops its loop, and so exits,
+//once the last of them is gone
+class live_connection
+{
+public:
+    live_connection()
+    {
+        count_++;
+    }
+    live_connection(const live_connection &) = delete;
+    live_connection &operator=(const live_connection &) = delete;
+    ~live_connection()
+    {
+        if (--count_ == 0 && child_context)
+            child_context->stop();
+    }
+    //set in a forked child only
+    static boost::asio::io_context *child_context;
+    static unsigned count()
+    {
+        return count_;
+    }
+
+private:
+    static std::atomic<unsigned> count_;
+};
+boost::asio::io_context *live_connection::child_context = nullptr;
+std::atomic<unsigned> live_connection::count_{0};
+
+//per-thread metric slots. only the owning thread writes its slot, with
+//relaxed load/store pairs instead of locked increments; a scrape sums the
+//slots of all threads. nothing on the relay path is shared between loops.
+class metrics
+{
+public:
+    enum phase
+    {
+        phase_parse,
+        phase_firewall,
+        phase_resolve,
+        phase_connect,
+        phase_count
+    };
+    enum
+    {
+        bucket_count = 12
+    };
+    struct histogram
+    {
+        std::atomic<uint64_t> buckets[bucket_count + 1];
+        std::atomic<uint64_t> sum_us;
+    };
+    struct slot
+    {
+        std::atomic<uint64_t> accepts, tunnels_opened, tunnels_closed;
+        std::atomic<uint64_t> bytes[2];
+        std::atomic<uint64_t> firewall_rejects, connect_errors, admission_rejects;
+        histogram handshake[phase_count];
+    };
+
+    static slot &local()
+    {
+        thread_local slot *s = add_slot();
+        return *s;
+    }
+    static void add(std::atomic<uint64_t> &counter, uint64_t n = 1)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    static void observe(phase p, std::chrono::steady_clock::duration d)
+    {
+        uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+        histogram &h = local().handshake[p];
+        std::size_t i = 0;
+        while (i < bucket_count && us > bucket_us[i])
+            i++;
+        add(h.buckets[i]);
+        add(h.sum_us, us);
+    }
+
+    static string render()
+    {
+        slot total{};
+        {
+            std::lock_guard<std::mutex> lock(slots_mutex());
+            for (auto &s : slots())
             {
-                cerr << "[connect error]: " << ec.message() << endl;
-                exit(1);
+                sum(total.accepts, s->accepts);
+                //closed first: a tunnel opened and closed in between
+                //then counts as open rather than as -1
+                sum(total.tunnels_closed, s->tunnels_closed);
+                sum(total.tunnels_opened, s->tunnels_opened);
+                sum(total.bytes[0], s->bytes[0]);
+                sum(total.bytes[1], s->bytes[1]);
+                sum(total.firewall_rejects, s->firewall_rejects);
+                sum(total.connect_errors, s->connect_errors);
+                sum(total.admission_rejects, s->admission_rejects);
+                for (int p = 0; p < phase_count; p++)
+                {
+                    for (int b = 0; b <= bucket_count; b++)
+                        sum(total.handshake[p].buckets[b], s->handshake[p].buckets[b]);
+                    sum(total.handshake[p].sum_us, s->handshake[p].sum_us);
+                }
             }
         }
-        else if (cd == 2)
+        std::ostringstream out;
+        counter(out, "socks_accepts_total", "Accepted client connections.", total.accepts);
+        out << "# HELP socks_active_tunnels Tunnels currently relaying.\n"
+            << "# TYPE socks_active_tunnels gauge\n"
+            << "socks_active_tunnels "
+            << std::max<int64_t>(0, int64_t(total.tunnels_opened.load() - total.tunnels_closed.load())) << "\n";
+        counter(out, "socks_tunnels_total", "Tunnels opened.", total.tunnels_opened);
+        out << "# HELP socks_live_connections Sessions, tunnels and UDP associations alive.\n"
+            << "# TYPE socks_live_connections gauge\n"
+            << "socks_live_connections " << live_connection::count() << "\n";
+        out << "# HELP socks_relayed_bytes_total Bytes relayed per direction.\n"
+            << "# TYPE socks_relayed_bytes_total counter\n"
+            << "socks_relayed_bytes_total{direction=\"upstream\"} " << total.bytes[0].load() << "\n"
+            << "socks_relayed_bytes_total{direction=\"downstream\"} " << total.bytes[1].load() << "\n";
+        counter(out, "socks_firewall_rejects_total", "Requests rejected by the firewall.", total.firewall_rejects);
+        counter(out, "socks_connect_errors_total", "Failed upstream connects.", total.connect_errors);
+        counter(out, "socks_admission_rejects_total", "Connections refused by admission limits.", total.admission_rejects);
+
+        static const char *phase_names[phase_count] = {"parse", "firewall", "resolve", "connect"};
+        out << "# HELP socks_handshake_seconds Handshake latency per phase.\n"
+            << "# TYPE socks_handshake_seconds histogram\n";
+        for (int p = 0; p < phase_count; p++)
         {
-            //bind
-            boost::system::error_code ec;
-            tcp::endpoint ep(tcp::v4(), INADDR_ANY);
-            tcp::acceptor acceptor_(io_context, ep);
+            uint64_t cumulative = 0;
+            for (int b = 0; b <= bucket_count; b++)
+            {
+                cumulative += total.handshake[p].buckets[b].load();
+                out << "socks_handshake_seconds_bucket{phase=\"" << phase_names[p] << "\",le=\"";
+                if (b < bucket_count)
+                    out << bucket_us[b] / 1e6;
+                else
+                    out << "+Inf";
+                out << "\"} " << cumulative << "\n";
+            }
+            out << "socks_handshake_seconds_sum{phase=\"" << phase_names[p] << "\"} " << total.handshake[p].sum_us.load() / 1e6 << "\n"
+                << "socks_handshake_seconds_count{phase=\"" << phase_names[p] << "\"} " << cumulative << "\n";
+        }
+        counter(out, "socks_dns_cache_hits_total", "SOCKS4a lookups served from the cache.", dns.hits);
+        counter(out, "socks_dns_cache_misses_total", "SOCKS4a lookups sent to the resolver.", dns.misses);
+        counter(out, "socks_dns_cache_coalesced_total", "SOCKS4a lookups that joined a pending query.", dns.coalesced);
+        counter(out, "socks_access_log_dropped_total", "Access log records dropped on a full ring.", access_log.dropped);
+        return out.str();
+    }
 
-            reply_[2] = ep.port() / 256;
-            reply_[3] = ep.port() % 256;
-            reply_[4] = reply_[5] = reply_[6] = reply_[7] = 0;
+private:
+    static constexpr uint64_t bucket_us[bucket_count] = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 1000000, 10000000};
 
-            socks_reply(reply_);
-            //cli_socket->send(boost::asio::buffer(reply_, 8));
-            acceptor_.accept(*dst_socket, ec);
-            //check accept ip with request dst_ip
-            socks_reply(reply_);
-            //cli_socket->send(boost::asio::buffer(reply_, 8));
-        }
-        //start relay session
-        auto relay_1 = std::make_shared<session>(cli_socket, dst_socket);
-        auto relay_2 = std::make_shared<session>(dst_socket, cli_socket);
-        relay_1->start();
-        relay_2->start();
+    //slots are never freed, a thread exiting leaves its totals behind
+    static std::vector<std::unique_ptr<slot>> &slots()
+    {
+        static std::vector<std::unique_ptr<slot>> s;
+        return s;
+    }
+    static std::mutex &slots_mutex()
+    {
+        static std::mutex m;
+        return m;
+    }
+    static slot *add_slot()
+    {
+        std::unique_ptr<slot> s(new slot());
+        std::lock_guard<std::mutex> lock(slots_mutex());
+        slots().push_back(std::move(s));
+        return slots().back().get();
+    }
+    static void sum(std::atomic<uint64_t> &to, const std::atomic<uint64_t> &from)
+    {
+        to.store(to.load(std::memory_order_relaxed) + from.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    static void counter(std::ostringstream &out, const char *name, const char *help, const std::atomic<uint64_t> &value)
+    {
+        out << "# HELP " << name << " " << help << "\n"
+            << "# TYPE " << name << " counter\n"
+            << name << " " << value.load() << "\n";
     }
 };
+constexpr uint64_t metrics::bucket_us[];
 
-class server
+//minimal HTTP/1.0 listener answering every request with the metrics text
+class metrics_server
 {
 public:
-    server(short port)
-        : acceptor_(io_context, tcp::endpoint(tcp::v4(), port))
+    //listener >= 0: a socket taken over from the previous process
+    metrics_server(boost::asio::io_context &io_context, unsigned short port, int listener = -1)
+        : acceptor_(io_context), retry_(io_context)
     {
+        if (listener >= 0)
+            acceptor_.assign(tcp::v4(), listener);
+        else
+        {
+            tcp::endpoint ep(tcp::v4(), port);
+            acceptor_.open(ep.protocol());
+            acceptor_.set_option(tcp::acceptor::reuse_address(true));
+            acceptor_.bind(ep);
+            acceptor_.listen();
+        }
         do_accept();
     }
+    int native_handle()
+    {
+        return acceptor_.native_handle();
+    }
+    //on a hot restart, once the new process holds the listener, and in a
+    //forked child, which must leave scrapes to its parent
+    void stop()
+    {
+        boost::system::error_code ignored;
+        acceptor_.close(ignored);
+        retry_.cancel();
+    }
 
 private:
-    void do_accept()
+    enum
     {
+        retry_ms = 100
+    };
+    struct scrape
+        : public std::enable_shared_from_this<scrape>
+    {
+        scrape(tcp::socket sock) : socket_(std::move(sock)) {}
+        tcp::socket socket_;
+        std::array<char, 1024> request_;
+        string response_;
 
-        auto socket_ = std::make_shared<tcp::socket>(io_context);
-        acceptor_.async_accept(*socket_,
-                               [this, socket_](boost::system::error_code ec) {
-                                   io_context.notify_fork(boost::asio::execution_context::fork_prepare);
-                                   if (fork() == 0)
-                                   {
-                                       io_context.notify_fork(boost::asio::execution_context::fork_child);
-                                       //socks_protocol(socket_);
-                                       std::make_shared<socks_sess> (socket_)->start();
-                                       cout << "close connection\n";
-                                   }
-                                   else
-                                   {
-                                       io_context.notify_fork(boost::asio::execution_context::fork_parent);
-                                       socket_->close();
-                                   }
-                                   do_accept();
-                               });
+        void start()
+        {
+            auto self(shared_from_this());
+            socket_.async_read_some(boost::asio::buffer(request_),
+                [this, self](boost::system::error_code ec, std::size_t) {
+                    if (ec)
+                        return;
+                    string body = metrics::render();
+                    response_ = "HTTP/1.0 200 OK\r\n"
+                                "Content-Type: text/plain; version=0.0.4\r\n"
+                                "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                                "Connection: close\r\n\r\n" + body;
+                    boost::asio::async_write(socket_, boost::asio::buffer(response_),
+                        [this, self](boost::system::error_code ec, std::size_t) {
+                            socket_.shutdown(tcp::socket::shutdown_both, ec);
+                        });
+                });
+        }
+    };
+
+    void do_accept()
+    {
+        acceptor_.async_accept([this](boost::system::error_code ec, tcp::socket sock) {
+            if (ec == boost::asio::error::operation_aborted)
+                return;
+            if (!ec)
+            {
+                std::make_shared<scrape>(std::move(sock))->start();
+                do_accept();
+                return;
+            }
+            //e.g. out of descriptors: retrying at once would spin the loop
+            //and starve the tunnels it serves
+            retry_.expires_after(std::chrono::milliseconds(retry_ms));
+            retry_.async_wait([this](boost::system::error_code ec) {
+                if (!ec && acceptor_.is_open())
+                    do_accept();
+            });
+        });
     }
     tcp::acceptor acceptor_;
+    boost::asio::steady_timer retry_;
 };
 
-int main(int argc, char *argv[])
+admission admission_;
+
+//live tunnels for --top-tunnels. like metrics, every thread owns a shard of
+//slots and is the only one to claim, free and count in them, so the relay
+//adds to a slot's byte counters with relaxed load/store pairs. the exporter
+//reads slots seqlock style: a slot's id is cleared before its endpoints are
+//rewritten, a copy taken while the id changed is thrown away.
+class tunnel_table
 {
-    try
+public:
+    enum
+    {
+        slot_bits = 20,
+        shard_bits = 12
+    };
+    struct shard;
+    struct slot
+    {
+        //0 = free, else the tunnel id: sequence << 32 | shard << 20 | slot
+        std::atomic<uint64_t> id{0};
+        std::atomic<uint64_t> bytes[2];
+        //written while id is 0
+        tcp::endpoint src, dst;
+        std::chrono::system_clock::time_point start;
+        std::chrono::steady_clock::time_point started;
+        u_char command = 0;
+        shard *owner = nullptr;
+    };
+    struct shard
+    {
+        std::unique_ptr<slot[]> slots;
+        std::size_t size = 0;
+        std::vector<uint32_t> free;
+        uint32_t index = 0;
+        uint32_t sequence = 0;
+        //tunnels that found the shard full
+        std::atomic<uint64_t> untracked{0};
+    };
+    //what the exporter copies out of a slot
+    struct entry
+    {
+        uint64_t id;
+        uint64_t bytes[2];
+        tcp::endpoint src, dst;
+        std::chrono::system_clock::time_point start;
+        std::chrono::steady_clock::time_point started;
+        u_char command;
+    };
+
+    bool enabled() const
     {
-        if (argc != 2)
+        return enabled_;
+    }
+    void enable()
+    {
+        enabled_ = true;
+    }
+
+    //null when the table is off or the thread's shard is full
+    slot *claim(const access_record &record)
+    {
+        if (!enabled_)
+            return nullptr;
+        shard *sh = local();
+        if (!sh)
+            return nullptr;
+        if (sh->free.empty())
         {
-            std::cerr << "Usage: socks_server <port>\n";
-            return 1;
+            metrics::add(sh->untracked);
+            return nullptr;
+        }
+        uint32_t i = sh->free.back();
+        sh->free.pop_back();
+        slot &s = sh->slots[i];
+        //the id's earlier store of 0 is ordered before the rewrite
+        std::atomic_thread_fence(std::memory_order_release);
+        s.bytes[0].store(0, std::memory_order_relaxed);
+        s.bytes[1].store(0, std::memory_order_relaxed);
+        s.src = record.src;
+        s.dst = record.dst;
+        s.start = record.start;
+        s.started = record.started;
+        s.command = record.command;
+        uint64_t sequence = ++sh->sequence ? sh->sequence : ++sh->sequence;
+        s.id.store(sequence << 32 | uint64_t(sh->index) << slot_bits | i, std::memory_order_release);
+        return &s;
+    }
+    void release(slot *s)
+    {
+        s->id.store(0, std::memory_order_relaxed);
+        s->owner->free.push_back(s - s->owner->slots.get());
+    }
+
+    //calls f(shard index, slot index, entry) for every slot in use; entry.id
+    //is 0 for a free slot
+    template <typename F>
+    void scan(F f)
+    {
+        std::lock_guard<std::mutex> lock(shards_mutex_);
+        for (auto &sh : shards_)
+            for (std::size_t i = 0; i < sh->size; i++)
+            {
+                slot &s = sh->slots[i];
+                entry e;
+                e.id = s.id.load(std::memory_order_acquire);
+                if (e.id)
+                {
+                    e.bytes[0] = s.bytes[0].load(std::memory_order_relaxed);
+                    e.bytes[1] = s.bytes[1].load(std::memory_order_relaxed);
+                    e.src = s.src;
+                    e.dst = s.dst;
+                    e.start = s.start;
+                    e.started = s.started;
+                    e.command = s.command;
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if (s.id.load(std::memory_order_relaxed) != e.id)
+                        e.id = 0;
+                }
+                f(sh->index, i, e);
+            }
+    }
+    uint64_t untracked()
+    {
+        uint64_t n = 0;
+        std::lock_guard<std::mutex> lock(shards_mutex_);
+        for (auto &sh : shards_)
+            n += sh->untracked.load(std::memory_order_relaxed);
+        return n;
+    }
+
+private:
+    bool enabled_ = false;
+    std::mutex shards_mutex_;
+    //shards are never freed, their slots outlive the thread's tunnels
+    std::vector<std::unique_ptr<shard>> shards_;
+
+    shard *local()
+    {
+        thread_local shard *s = add_shard();
+        return s;
+    }
+    shard *add_shard()
+    {
+        std::lock_guard<std::mutex> lock(shards_mutex_);
+        if (shards_.size() >= 1u << shard_bits)
+            return nullptr;
+        std::unique_ptr<shard> sh(new shard());
+        sh->size = std::min<std::size_t>(options.tunnel_slots, 1u << slot_bits);
+        sh->slots.reset(new slot[sh->size]);
+        sh->index = shards_.size();
+        //claimed from the back, lowest slots first
+        for (std::size_t i = sh->size; i-- > 0;)
+        {
+            sh->slots[i].owner = sh.get();
+            sh->free.push_back(i);
         }
-        server s(std::atoi(argv[1]));
-        io_context.run();
+        shards_.push_back(std::move(sh));
+        return shards_.back().get();
+    }
+};
+tunnel_table live_tunnels;
+
+//--top-tunnels: every interval a background thread ranks the live tunnels
+//by bandwidth over the interval and writes the busiest ones, replacing a
+//file with rename() or as one datagram to a Unix socket.
+class top_exporter
+{
+public:
+    ~top_exporter() { close(); }
+
+    bool open(const string &path)
+    {
+        if (path.compare(0, 5, "unix:") == 0)
+        {
+            socket_path_ = path.substr(5);
+            fd_ = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd_ < 0 || socket_path_.empty() || socket_path_.size() >= sizeof(sockaddr_un::sun_path))
+                return false;
+        }
+        else
+            file_path_ = path;
+        live_tunnels.enable();
+        running_ = true;
+        exporter_ = std::thread([this] { run(); });
+        return true;
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            running_ = false;
+        }
+        wake_.notify_one();
+        if (exporter_.joinable())
+            exporter_.join();
+        if (fd_ >= 0)
+            ::close(fd_);
+        fd_ = -1;
+    }
+
+private:
+    //the byte counts of a slot's tunnel at the previous snapshot
+    struct seen
+    {
+        uint64_t id = 0;
+        uint64_t bytes[2] = {0, 0};
+    };
+    struct ranked
+    {
+        tunnel_table::entry e;
+        double rate[2];
+    };
+
+    string file_path_, socket_path_;
+    int fd_ = -1;
+    std::thread exporter_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    bool running_ = false;
+    std::vector<std::vector<seen>> seen_;
+    std::vector<ranked> ranked_;
+
+    void run()
+    {
+        auto last = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!wake_.wait_for(lock, options.top_interval, [this] { return !running_; }))
+        {
+            lock.unlock();
+            auto now = std::chrono::steady_clock::now();
+            string snapshot = take(now, now - last);
+            last = now;
+            write(snapshot);
+            lock.lock();
+        }
+    }
+
+    string take(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::duration interval)
+    {
+        ranked_.clear();
+        live_tunnels.scan([&](uint32_t shard, std::size_t i, const tunnel_table::entry &e) {
+            if (seen_.size() <= shard)
+                seen_.resize(shard + 1);
+            if (seen_[shard].size() <= i)
+                seen_[shard].resize(i + 1);
+            seen &s = seen_[shard][i];
+            if (!e.id)
+            {
+                s = seen();
+                return;
+            }
+            if (s.id != e.id)
+                s = seen();
+            //a tunnel younger than the interval is rated over its lifetime
+            double seconds = std::chrono::duration<double>(std::min(interval, now - e.started)).count();
+            ranked r;
+            r.e = e;
+            for (int d = 0; d < 2; d++)
+                r.rate[d] = seconds > 0 ? (e.bytes[d] - s.bytes[d]) / seconds : 0;
+            s.id = e.id;
+            s.bytes[0] = e.bytes[0];
+            s.bytes[1] = e.bytes[1];
+            ranked_.push_back(r);
+        });
+        std::size_t n = std::min<std::size_t>(options.top_count, ranked_.size());
+        std::partial_sort(ranked_.begin(), ranked_.begin() + n, ranked_.end(), [](const ranked &a, const ranked &b) {
+            return a.rate[0] + a.rate[1] > b.rate[0] + b.rate[1];
+        });
+
+        static const char *commands[] = {"-", "connect", "bind", "udp"};
+        char line[512];
+        std::time_t t = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        char time[32];
+        strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%SZ", &tm);
+        snprintf(line, sizeof(line), "# %s tunnels=%zu untracked=%llu interval=%.3f\n", time, ranked_.size(),
+                 (unsigned long long)live_tunnels.untracked(), std::chrono::duration<double>(interval).count());
+        string out = line;
+        for (std::size_t i = 0; i < n; i++)
+        {
+            const ranked &r = ranked_[i];
+            snprintf(line, sizeof(line), "%llu %s %s %s up=%llu down=%llu up_rate=%.0f down_rate=%.0f age=%.3f\n",
+                     (unsigned long long)r.e.id, access_logger::endpoint_string(r.e.src).c_str(),
+                     access_logger::endpoint_string(r.e.dst).c_str(), r.e.command < 4 ? commands[r.e.command] : "?",
+                     (unsigned long long)r.e.bytes[0], (unsigned long long)r.e.bytes[1], r.rate[0], r.rate[1],
+                     std::chrono::duration<double>(now - r.e.started).count());
+            out += line;
+        }
+        return out;
+    }
+
+    void write(const string &snapshot)
+    {
+        if (fd_ >= 0)
+        {
+            //nobody listening, or a full socket buffer: this snapshot is lost
+            sockaddr_un addr = sockaddr_un();
+            addr.sun_family = AF_UNIX;
+            std::memcpy(addr.sun_path, socket_path_.data(), socket_path_.size());
+            sendto(fd_, snapshot.data(), snapshot.size(), 0, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+            return;
+        }
+        //readers see either the previous snapshot or this one, never a torn file
+        string tmp = file_path_ + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return;
+        bool ok = ::write(fd, snapshot.data(), snapshot.size()) == ssize_t(snapshot.size());
+        ::close(fd);
+        if (ok)
+            rename(tmp.c_str(), file_path_.c_str());
+    }
+};
+top_exporter top_tunnels;
+
+//per-thread free lists of relay buffers, one list per power of two size
+//class. every event loop runs on its own thread, so no locking is needed; a
+//buffer is only held while a read/write is in flight and goes back to the
+//list as soon as the write completes.
+class buffer_pool
+{
+public:
+    enum
+    {
+        min_size = 4096,
+        size_classes = 7,
+        max_cached_bytes = 4 << 20
+    };
+    ~buffer_pool()
+    {
+        for (auto &list : free_)
+            for (u_char *b : list)
+                delete[] b;
+    }
+    u_char *acquire(std::size_t size)
+    {
+        auto &list = free_[size_class(size)];
+        if (list.empty())
+            return new u_char[size];
+        u_char *b = list.back();
+        list.pop_back();
+        return b;
+    }
+    void release(u_char *b, std::size_t size)
+    {
+        auto &list = free_[size_class(size)];
+        if ((list.size() + 1) * size <= max_cached_bytes)
+            list.push_back(b);
+        else
+            delete[] b;
+    }
+    static buffer_pool &local()
+    {
+        thread_local buffer_pool pool;
+        return pool;
+    }
+
+private:
+    std::vector<u_char *> free_[size_classes];
+
+    static std::size_t size_class(std::size_t size)
+    {
+        std::size_t i = 0;
+        while ((std::size_t(min_size) << i) < size)
+            i++;
+        return i;
+    }
+};
+
+//handler memory recycling, as in the asio allocation example. a relay
+//direction has at most one operation outstanding, so one slot is enough to
+//keep the steady state read/write loop free of allocations.
+class handler_memory
+{
+public:
+    handler_memory() {}
+    handler_memory(const handler_memory &) = delete;
+    handler_memory &operator=(const handler_memory &) = delete;
+
+    void *allocate(std::size_t size)
+    {
+        if (!in_use_ && size <= sizeof(storage_))
+        {
+            in_use_ = true;
+            return &storage_;
+        }
+        return ::operator new(size);
+    }
+    void deallocate(void *pointer)
+    {
+        if (pointer == &storage_)
+            in_use_ = false;
+        else
+            ::operator delete(pointer);
+    }
+
+private:
+    typename std::aligned_storage<256>::type storage_;
+    bool in_use_ = false;
+};
+
+template <typename T>
+class handler_allocator
+{
+public:
+    using value_type = T;
+
+    explicit handler_allocator(handler_memory &mem) : memory_(mem) {}
+    template <typename U>
+    handler_allocator(const handler_allocator<U> &other) noexcept : memory_(other.memory_) {}
+
+    bool operator==(const handler_allocator &other) const noexcept { return &memory_ == &other.memory_; }
+    bool operator!=(const handler_allocator &other) const noexcept { return &memory_ != &other.memory_; }
+    T *allocate(std::size_t n) const { return static_cast<T *>(memory_.allocate(sizeof(T) * n)); }
+    void deallocate(T *p, std::size_t /*n*/) const { memory_.deallocate(p); }
+
+private:
+    template <typename>
+    friend class handler_allocator;
+    handler_memory &memory_;
+};
+
+template <typename Handler>
+class custom_alloc_handler
+{
+public:
+    using allocator_type = handler_allocator<Handler>;
+
+    custom_alloc_handler(handler_memory &m, Handler h) : memory_(m), handler_(std::move(h)) {}
+    allocator_type get_allocator() const noexcept { return allocator_type(memory_); }
+    template <typename... Args>
+    void operator()(Args &&... args) { handler_(std::forward<Args>(args)...); }
+
+private:
+    handler_memory &memory_;
+    Handler handler_;
+};
+
+template <typename Handler>
+inline custom_alloc_handler<Handler> make_custom_alloc_handler(handler_memory &m, Handler h)
+{
+    return custom_alloc_handler<Handler>(m, std::move(h));
+}
+
+//io_uring ring of one event loop, driven by raw syscalls. the ring fd is
+//watched by the loop's io_context, so completions run as ordinary handlers
+//on the loop's thread; SQEs queued while handlers run go to the kernel in
+//one io_uring_enter per loop turn. receives pick their buffer from a ring
+//of provided buffers, so a tunnel waiting for data holds none.
+class uring
+{
+public:
+    //the owner of a submitted request, user_data of its SQE
+    struct operation
+    {
+        virtual void complete(int res, unsigned flags) = 0;
+
+    protected:
+        ~operation() {}
+    };
+    enum
+    {
+        entries = 4096,
+        buffer_size = 64 * 1024,
+        buffer_group = 0
+    };
+
+    uring(boost::asio::io_context &io_context) : io_context_(io_context), ring_fd_(io_context) {}
+    ~uring()
+    {
+        if (sq_ring_ != MAP_FAILED)
+            munmap(sq_ring_, ring_size_);
+        if (sqes_ != MAP_FAILED)
+            munmap(sqes_, entries * sizeof(io_uring_sqe));
+        if (buffer_ring_ != MAP_FAILED)
+            munmap(buffer_ring_, buffer_ring_size());
+        if (buffers_ != MAP_FAILED)
+            munmap(buffers_, std::size_t(buffer_count_) * buffer_size);
+    }
+
+    //buffers is rounded up to a power of two
+    void open(unsigned buffers, boost::system::error_code &ec)
+    {
+        io_uring_params p;
+        std::memset(&p, 0, sizeof(p));
+        //not IORING_SETUP_SINGLE_ISSUER: rings are set up by the main thread,
+        //loops other than the first then submit from their own
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = 4 * entries;
+        int fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (fd < 0)
+        {
+            ec = boost::system::error_code(errno, boost::system::system_category());
+            return;
+        }
+        ring_fd_.assign(fd, ec);
+        if (ec)
+        {
+            ::close(fd);
+            return;
+        }
+        //needs 5.19: one mapping for both rings and provided buffer rings
+        if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP))
+        {
+            ec = boost::asio::error::operation_not_supported;
+            return;
+        }
+        ring_size_ = std::max(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                              p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe));
+        sq_ring_ = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        sqes_ = mmap(nullptr, entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     fd, IORING_OFF_SQES);
+        if (sq_ring_ == MAP_FAILED || sqes_ == MAP_FAILED)
+        {
+            ec = boost::system::error_code(errno, boost::system::system_category());
+            return;
+        }
+        char *base = static_cast<char *>(sq_ring_);
+        sq_head_ = reinterpret_cast<unsigned *>(base + p.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned *>(base + p.sq_off.tail);
+        sq_flags_ = reinterpret_cast<unsigned *>(base + p.sq_off.flags);
+        sq_mask_ = *reinterpret_cast<unsigned *>(base + p.sq_off.ring_mask);
+        cq_head_ = reinterpret_cast<unsigned *>(base + p.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned *>(base + p.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned *>(base + p.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe *>(base + p.cq_off.cqes);
+        //SQE i always sits in slot i
+        unsigned *array = reinterpret_cast<unsigned *>(base + p.sq_off.array);
+        for (unsigned i = 0; i < p.sq_entries; i++)
+            array[i] = i;
+        tail_ = *sq_tail_;
+
+        for (buffer_count_ = 1; buffer_count_ < std::max(1u, buffers); buffer_count_ *= 2)
+            ;
+        buffer_ring_ = mmap(nullptr, buffer_ring_size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        buffers_ = mmap(nullptr, std::size_t(buffer_count_) * buffer_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer_ring_ == MAP_FAILED || buffers_ == MAP_FAILED)
+        {
+            ec = boost::system::error_code(errno, boost::system::system_category());
+            return;
+        }
+        io_uring_buf_reg reg;
+        std::memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = reinterpret_cast<uint64_t>(buffer_ring_);
+        reg.ring_entries = buffer_count_;
+        reg.bgid = buffer_group;
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        {
+            ec = boost::system::error_code(errno, boost::system::system_category());
+            return;
+        }
+        for (unsigned id = 0; id < buffer_count_; id++)
+            recycle(id);
+        wait();
+    }
+
+    //multishot: one SQE keeps accepting until it fails
+    void accept(int listener, operation *op)
+    {
+        io_uring_sqe &sqe = get_sqe(IORING_OP_ACCEPT, listener, op);
+        sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe.accept_flags = SOCK_CLOEXEC;
+    }
+    //completes with the buffer id in flags, -ENOBUFS once all buffers are in use
+    void recv(int fd, operation *op)
+    {
+        io_uring_sqe &sqe = get_sqe(IORING_OP_RECV, fd, op);
+        sqe.flags = IOSQE_BUFFER_SELECT;
+        sqe.buf_group = buffer_group;
+        sqe.len = buffer_size;
+    }
+    void send(int fd, const u_char *data, std::size_t length, operation *op)
+    {
+        io_uring_sqe &sqe = get_sqe(IORING_OP_SEND, fd, op);
+        sqe.addr = reinterpret_cast<uint64_t>(data);
+        sqe.len = length;
+        sqe.msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    }
+    //the request still completes, with -ECANCELED unless it already finished
+    void cancel(operation *op)
+    {
+        io_uring_sqe &sqe = get_sqe(IORING_OP_ASYNC_CANCEL, -1, nullptr);
+        sqe.addr = reinterpret_cast<uint64_t>(op);
+    }
+
+    static bool has_buffer(unsigned flags)
+    {
+        return flags & IORING_CQE_F_BUFFER;
+    }
+    static unsigned buffer_id(unsigned flags)
+    {
+        return flags >> IORING_CQE_BUFFER_SHIFT;
+    }
+    u_char *buffer(unsigned id)
+    {
+        return static_cast<u_char *>(buffers_) + std::size_t(id) * buffer_size;
+    }
+    //hands a buffer back to the kernel once its data is sent
+    void recycle(unsigned id)
+    {
+        io_uring_buf &b = static_cast<io_uring_buf *>(buffer_ring_)[buffer_tail_ & (buffer_count_ - 1)];
+        b.addr = reinterpret_cast<uint64_t>(buffer(id));
+        b.len = buffer_size;
+        b.bid = id;
+        //the tail overlays the reserved field of the first entry
+        __atomic_store_n(&static_cast<io_uring_buf *>(buffer_ring_)[0].resv, ++buffer_tail_, __ATOMIC_RELEASE);
+    }
+
+private:
+    boost::asio::io_context &io_context_;
+    boost::asio::posix::stream_descriptor ring_fd_;
+    void *sq_ring_ = MAP_FAILED;
+    std::size_t ring_size_ = 0;
+    void *sqes_ = MAP_FAILED;
+    unsigned *sq_head_ = nullptr, *sq_tail_ = nullptr, *sq_flags_ = nullptr;
+    unsigned *cq_head_ = nullptr, *cq_tail_ = nullptr;
+    unsigned sq_mask_ = 0, cq_mask_ = 0;
+    io_uring_cqe *cqes_ = nullptr;
+    //SQEs queued so far, published to the kernel on submit()
+    unsigned tail_ = 0;
+    bool submit_posted_ = false;
+    void *buffer_ring_ = MAP_FAILED;
+    void *buffers_ = MAP_FAILED;
+    unsigned buffer_count_ = 0;
+    uint16_t buffer_tail_ = 0;
+
+    std::size_t buffer_ring_size() const
+    {
+        return std::size_t(buffer_count_) * sizeof(io_uring_buf);
+    }
+
+    io_uring_sqe &get_sqe(int opcode, int fd, operation *op)
+    {
+        if (tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == entries)
+            submit();
+        else if (!submit_posted_)
+        {
+            //everything queued by the handlers of this turn goes in one syscall
+            submit_posted_ = true;
+            boost::asio::post(io_context_, [this] { run(); });
+        }
+        io_uring_sqe &sqe = static_cast<io_uring_sqe *>(sqes_)[tail_++ & sq_mask_];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = opcode;
+        sqe.fd = fd;
+        sqe.user_data = reinterpret_cast<uint64_t>(op);
+        return sqe;
+    }
+
+    //returns whether anything was submitted
+    bool submit()
+    {
+        submit_posted_ = false;
+        __atomic_store_n(sq_tail_, tail_, __ATOMIC_RELEASE);
+        bool submitted = false;
+        for (;;)
+        {
+            unsigned pending = tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+            if (pending == 0)
+                return submitted;
+            submitted = true;
+            //-EBUSY while completions back up: retried once they are reaped
+            if (syscall(__NR_io_uring_enter, ring_fd_.native_handle(), pending, 0, 0, nullptr, 0) < 0 &&
+                errno != EINTR)
+                return submitted;
+        }
+    }
+
+    bool completed() const
+    {
+        return *cq_head_ != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) ||
+               (__atomic_load_n(sq_flags_, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW);
+    }
+
+    //requests that finish inline, such as a send into a socket with room,
+    //complete during the submit itself: reap those without a trip through epoll
+    void run()
+    {
+        do
+            reap();
+        while (submit() && completed());
+    }
+
+    void wait()
+    {
+        ring_fd_.async_wait(boost::asio::posix::stream_descriptor::wait_read, [this](boost::system::error_code ec) {
+            if (ec)
+                return;
+            run();
+            wait();
+        });
+    }
+
+    void reap()
+    {
+        for (;;)
+        {
+            unsigned head = *cq_head_;
+            unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+            if (head == tail)
+            {
+                //completions that did not fit are flushed into the ring by the kernel
+                if (!(__atomic_load_n(sq_flags_, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW))
+                    return;
+                syscall(__NR_io_uring_enter, ring_fd_.native_handle(), 0, 0, IORING_ENTER_GETEVENTS, nullptr, 0);
+                continue;
+            }
+            for (; head != tail; head++)
+            {
+                io_uring_cqe cqe = cqes_[head & cq_mask_];
+                //the slot may be reused as soon as the head moves past it
+                __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+                if (cqe.user_data)
+                    reinterpret_cast<operation *>(cqe.user_data)->complete(cqe.res, cqe.flags);
+            }
+        }
+    }
+};
+
+//both relay directions of one SOCKS tunnel. EOF on one side is forwarded as
+//a shutdown of the peer's write side and the sockets are closed only when
+//both directions are finished, so half-closing protocols keep working.
+//
+//a direction either copies through a pooled buffer whose size follows the
+//observed read sizes (4 KiB - 256 KiB), or with -z moves data socket ->
+//pipe -> socket with splice() so the payload never enters user space, or
+//with --io-uring receives into the loop's provided buffers and sends from
+//there, each step one SQE.
+class parent_lease;
+class tunnel
+    : public std::enable_shared_from_this<tunnel>
+{
+public:
+    //lease: the parent proxy upstream leads to, if any
+    tunnel(tcp::socket client, tcp::socket upstream, const access_record &record,
+           shared_ptr<admission::ticket> ticket, timing_wheel &wheel, uring *ring,
+           shared_ptr<parent_lease> lease = nullptr)
+        : client_(std::move(client)), upstream_(std::move(upstream)), record_(record), ticket_(std::move(ticket)),
+          lease_(std::move(lease)), slot_(live_tunnels.claim(record)), wheel_(wheel), ring_(ring)
+    {
+        dirs_[0].from = dirs_[1].to = &client_;
+        dirs_[0].to = dirs_[1].from = &upstream_;
+        for (auto &d : dirs_)
+        {
+            d.op.owner = this;
+            d.op.d = &d;
+        }
+        for (auto &d : dirs_)
+            d.shaper.configure(options.tunnel_bandwidth, admission::bandwidth_burst);
+    }
+    ~tunnel()
+    {
+        for (auto &d : dirs_)
+        {
+            release_buffer(d);
+            close_pipe(d);
+        }
+        metrics::add(metrics::local().tunnels_closed);
+        if (slot_)
+            live_tunnels.release(slot_);
+        record_.bytes[0] = dirs_[0].total;
+        record_.bytes[1] = dirs_[1].total;
+        record_.duration = std::chrono::steady_clock::now() - record_.started;
+        access_log.write(record_);
+    }
+    void start()
+    {
+        metrics::add(metrics::local().tunnels_opened);
+        boost::system::error_code ec;
+        //user level non-blocking: a read after a stale readiness edge must
+        //return would_block, not fall back to a blocking poll()
+        client_.non_blocking(true, ec);
+        upstream_.non_blocking(true, ec);
+        if (options.splice)
+        {
+            for (auto &d : dirs_)
+                d.splice = pipe2(d.pipe, O_NONBLOCK | O_CLOEXEC) == 0;
+            if (!dirs_[0].splice || !dirs_[1].splice)
+                for (auto &d : dirs_)
+                    close_pipe(d);
+        }
+        touch();
+        do_read(dirs_[0]);
+        do_read(dirs_[1]);
+    }
+
+private:
+    enum
+    {
+        min_buffer = buffer_pool::min_size,
+        max_buffer = 256 * 1024,
+        shrink_after = 4,
+        pipe_size = 1 << 16
+    };
+    struct direction
+    {
+        tcp::socket *from = nullptr;
+        tcp::socket *to = nullptr;
+        u_char *buffer = nullptr;
+        std::size_t buffer_size = min_buffer;
+        unsigned small_reads = 0;
+        bool splice = false;
+        int pipe[2] = {-1, -1};
+        std::size_t in_pipe = 0;
+        std::size_t total = 0;
+        bool done = false;
+        handler_memory memory;
+        rate_limiter shaper;
+        //when shaping allows the next read, and the timer waiting for it
+        int64_t resume = 0;
+        std::unique_ptr<boost::asio::steady_timer> hold;
+
+        //io_uring: the direction's one recv or send in flight, which keeps
+        //the tunnel alive, and the provided buffer being sent
+        struct ring_operation : uring::operation
+        {
+            tunnel *owner;
+            direction *d;
+            void complete(int res, unsigned flags) override
+            {
+                owner->ring_complete(*d, res, flags);
+            }
+        } op;
+        shared_ptr<tunnel> pinned;
+        bool sending = false;
+        unsigned buffer_id = 0;
+        std::size_t length = 0, sent = 0;
+    };
+    tcp::socket client_;
+    tcp::socket upstream_;
+    direction dirs_[2];
+    bool closed_ = false;
+    access_record record_;
+    shared_ptr<admission::ticket> ticket_;
+    shared_ptr<parent_lease> lease_;
+    //--top-tunnels, null when untracked
+    tunnel_table::slot *slot_;
+    live_connection live_;
+    timing_wheel &wheel_;
+    timing_wheel::timer idle_{[this] { stop("idle", boost::asio::error::timed_out); }};
+    uring *ring_;
+
+    //bytes read in direction d, for the access log, the metrics and the tunnel table
+    void count(direction &d, std::size_t n)
+    {
+        d.total += n;
+        metrics::add(metrics::local().bytes[&d - dirs_], n);
+        if (slot_)
+            metrics::add(slot_->bytes[&d - dirs_], n);
+    }
+
+    //every read in either direction pushes the idle deadline back
+    void touch()
+    {
+        if (options.idle_timeout.count())
+            idle_.expires_after(wheel_, options.idle_timeout);
+    }
+
+    //bytes just read are charged to the tunnel's and the client's buckets,
+    //the next read of that direction waits until both are back in credit
+    void charge(direction &d, std::size_t length)
+    {
+        admission::client *c = ticket_ ? ticket_->owner() : nullptr;
+        bool by_client = c && c->bandwidth[&d - dirs_].enabled();
+        if (!d.shaper.enabled() && !by_client)
+            return;
+        int64_t now = rate_limiter::now();
+        rate_limiter::duration wait(0);
+        if (d.shaper.enabled())
+            wait = d.shaper.take(length, now);
+        if (by_client)
+            wait = std::max(wait, c->bandwidth[&d - dirs_].take(length, now));
+        d.resume = now + wait.count();
+    }
+
+    void next_read(direction &d)
+    {
+        int64_t wait = d.resume - rate_limiter::now();
+        if (wait <= 0)
+        {
+            do_read(d);
+            return;
+        }
+        if (!d.hold)
+            d.hold.reset(new boost::asio::steady_timer(client_.get_executor()));
+        d.hold->expires_after(rate_limiter::duration(wait));
+        auto self(shared_from_this());
+        d.hold->async_wait(make_custom_alloc_handler(d.memory, [this, self, &d](boost::system::error_code ec) {
+            if (!ec && !closed_)
+                do_read(d);
+        }));
+    }
+
+    void do_read(direction &d)
+    {
+        if (ring_ && !d.splice)
+            ring_read(d);
+        else
+            wait_read(d);
+    }
+
+    //wait for readability first, idle tunnels hold no relay buffer
+    void wait_read(direction &d)
+    {
+        auto self(shared_from_this());
+        d.from->async_wait(tcp::socket::wait_read,
+                           make_custom_alloc_handler(d.memory, [this, self, &d](boost::system::error_code ec) {
+                               if (ec)
+                                   stop("read", ec);
+                               else if (d.splice)
+                                   splice_read(d);
+                               else
+                                   buffered_read(d);
+                           }));
+    }
+
+    void buffered_read(direction &d)
+    {
+        boost::system::error_code ec;
+        d.buffer = buffer_pool::local().acquire(d.buffer_size);
+        std::size_t length = d.from->read_some(boost::asio::buffer(d.buffer, d.buffer_size), ec);
+        if (ec)
+        {
+            release_buffer(d);
+            if (ec == boost::asio::error::would_block)
+                wait_read(d);
+            else if (ec == boost::asio::error::eof)
+                finish(d);
+            else
+                stop("read", ec);
+            return;
+        }
+        count(d, length);
+        touch();
+        charge(d, length);
+        do_write(d, length);
+    }
+
+    void do_write(direction &d, std::size_t length)
+    {
+        auto self(shared_from_this());
+        boost::asio::async_write(*d.to, boost::asio::buffer(d.buffer, length),
+                                 make_custom_alloc_handler(d.memory, [this, self, &d, length](boost::system::error_code ec, std::size_t /*write_length*/) {
+                                     release_buffer(d);
+                                     if (ec)
+                                     {
+                                         stop("write", ec);
+                                         return;
+                                     }
+                                     adapt_buffer(d, length);
+                                     next_read(d);
+                                 }));
+    }
+
+    //full reads double the buffer, a run of small reads halves it
+    void adapt_buffer(direction &d, std::size_t length)
+    {
+        if (length == d.buffer_size)
+        {
+            d.small_reads = 0;
+            if (d.buffer_size < max_buffer)
+                d.buffer_size *= 2;
+        }
+        else if (length < d.buffer_size / 4 && d.buffer_size > min_buffer)
+        {
+            if (++d.small_reads >= shrink_after)
+            {
+                d.small_reads = 0;
+                d.buffer_size /= 2;
+            }
+        }
+        else
+            d.small_reads = 0;
+    }
+
+    void splice_read(direction &d)
+    {
+        ssize_t n = ::splice(d.from->native_handle(), nullptr, d.pipe[1], nullptr,
+                             pipe_size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+        {
+            d.in_pipe += n;
+            count(d, n);
+            touch();
+            charge(d, n);
+            splice_write(d);
+        }
+        else if (n == 0)
+            finish(d);
+        else if (errno == EAGAIN || errno == EINTR)
+            wait_read(d);
+        else if (errno == EINVAL && d.total == 0)
+        {
+            //splice not supported for this socket, nothing moved yet
+            d.splice = false;
+            close_pipe(d);
+            buffered_read(d);
+        }
+        else
+            stop("read", boost::system::error_code(errno, boost::system::system_category()));
+    }
+
+    void splice_write(direction &d)
+    {
+        while (d.in_pipe > 0)
+        {
+            ssize_t n = ::splice(d.pipe[0], nullptr, d.to->native_handle(), nullptr,
+                                 d.in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0)
+                d.in_pipe -= n;
+            else if (n < 0 && errno == EINTR)
+                continue;
+            else if (n < 0 && errno == EAGAIN)
+            {
+                auto self(shared_from_this());
+                d.to->async_wait(tcp::socket::wait_write,
+                                 make_custom_alloc_handler(d.memory, [this, self, &d](boost::system::error_code ec) {
+                                     if (ec)
+                                         stop("write", ec);
+                                     else
+                                         splice_write(d);
+                                 }));
+                return;
+            }
+            else
+            {
+                stop("write", boost::system::error_code(errno, boost::system::system_category()));
+                return;
+            }
+        }
+        next_read(d);
+    }
+
+    void ring_read(direction &d)
+    {
+        d.pinned = shared_from_this();
+        d.sending = false;
+        ring_->recv(d.from->native_handle(), &d.op);
+    }
+
+    void ring_send(direction &d)
+    {
+        d.pinned = shared_from_this();
+        d.sending = true;
+        ring_->send(d.to->native_handle(), ring_->buffer(d.buffer_id) + d.sent, d.length - d.sent, &d.op);
+    }
+
+    //the send goes out with the next batch of SQEs: a linked recv -> send
+    //pair cannot name the length or the buffer the recv is going to pick
+    void ring_complete(direction &d, int res, unsigned flags)
+    {
+        auto self(std::move(d.pinned));
+        if (!d.sending)
+        {
+            if (uring::has_buffer(flags))
+            {
+                d.buffer_id = uring::buffer_id(flags);
+                d.length = res;
+                d.sent = 0;
+                if (closed_ || res <= 0)
+                    ring_->recycle(d.buffer_id);
+            }
+            if (closed_)
+                return;
+            //all provided buffers are in use, this chunk takes a pooled one
+            else if (res == -ENOBUFS)
+                wait_read(d);
+            else if (res == 0)
+                finish(d);
+            else if (res < 0)
+                stop("read", boost::system::error_code(-res, boost::system::system_category()));
+            else
+            {
+                count(d, res);
+                touch();
+                charge(d, res);
+                ring_send(d);
+            }
+            return;
+        }
+        if (res > 0)
+            d.sent += res;
+        if (closed_ || res < 0 || d.sent == d.length)
+            ring_->recycle(d.buffer_id);
+        if (closed_)
+            return;
+        if (res < 0)
+            stop("write", boost::system::error_code(-res, boost::system::system_category()));
+        else if (d.sent < d.length)
+            ring_send(d);
+        else
+            next_read(d);
+    }
+
+    //EOF on d.from: pass the FIN on and close once the other side is done too
+    void finish(direction &d)
+    {
+        boost::system::error_code ec;
+        d.done = true;
+        d.to->shutdown(tcp::socket::shutdown_send, ec);
+        if (dirs_[0].done && dirs_[1].done)
+            stop(nullptr, ec);
+    }
+
+    void stop(const char *what, boost::system::error_code ec)
+    {
+        if (closed_)
+            return;
+        closed_ = true;
+        if (what && ec != boost::asio::error::operation_aborted)
+        {
+            record_.stage = what;
+            record_.error = ec;
+        }
+        boost::system::error_code ignored;
+        client_.close(ignored);
+        upstream_.close(ignored);
+        for (auto &d : dirs_)
+        {
+            if (d.hold)
+                d.hold->cancel();
+            //a request holds its own reference to the socket, closing does not end it
+            if (d.pinned)
+                ring_->cancel(&d.op);
+        }
+        idle_.cancel();
+    }
+
+    void release_buffer(direction &d)
+    {
+        if (d.buffer)
+            buffer_pool::local().release(d.buffer, d.buffer_size);
+        d.buffer = nullptr;
+    }
+
+    static void close_pipe(direction &d)
+    {
+        for (int &fd : d.pipe)
+        {
+            if (fd >= 0)
+                ::close(fd);
+            fd = -1;
+        }
+        d.splice = false;
+    }
+};
+
+//SOCKS5 (RFC 1928) commands, address types and reply codes. SOCKS4 requests
+//use the same command numbers, their replies are mapped from these codes.
+enum
+{
+    socks5_connect = 1,
+    socks5_bind = 2,
+    socks5_udp_associate = 3,
+
+    socks5_atyp_ipv4 = 1,
+    socks5_atyp_domain = 3,
+    socks5_atyp_ipv6 = 4,
+
+    socks5_no_auth = 0,
+    socks5_no_acceptable_method = 0xff,
+
+    socks5_succeeded = 0,
+    socks5_general_failure,
+    socks5_not_allowed,
+    socks5_network_unreachable,
+    socks5_host_unreachable,
+    socks5_refused,
+    socks5_ttl_expired,
+    socks5_command_unsupported,
+    socks5_address_unsupported
+};
+
+//ATYP, address and port as they appear in requests and UDP headers. the
+//domain points into the parsed buffer.
+struct socks5_address
+{
+    boost::asio::ip::address addr;
+    boost::string_view domain;
+    u_short port = 0;
+};
+
+//returns the bytes parsed, 0 if more are needed, -1 for an unknown address type
+inline std::size_t parse_socks5_address(const u_char *p, std::size_t n, socks5_address &out)
+{
+    if (n < 1)
+        return 0;
+    std::size_t length;
+    switch (p[0])
+    {
+    case socks5_atyp_ipv4:
+    {
+        length = 1 + 4 + 2;
+        if (n < length)
+            return 0;
+        boost::asio::ip::address_v4::bytes_type ip;
+        std::copy(p + 1, p + 5, ip.begin());
+        out.addr = boost::asio::ip::address_v4(ip);
+        break;
+    }
+    case socks5_atyp_ipv6:
+    {
+        length = 1 + 16 + 2;
+        if (n < length)
+            return 0;
+        boost::asio::ip::address_v6::bytes_type ip;
+        std::copy(p + 1, p + 17, ip.begin());
+        out.addr = boost::asio::ip::address_v6(ip);
+        break;
+    }
+    case socks5_atyp_domain:
+        if (n < 2)
+            return 0;
+        length = 2 + p[1] + 2;
+        if (n < length)
+            return 0;
+        out.domain = boost::string_view(reinterpret_cast<const char *>(p + 2), p[1]);
+        break;
+    default:
+        return std::size_t(-1);
+    }
+    out.port = p[length - 2] << 8 | p[length - 1];
+    return length;
+}
+
+//writes ATYP, address and port, v4-mapped addresses as IPv4; returns the length
+inline std::size_t put_socks5_address(u_char *p, const boost::asio::ip::address &addr, u_short port)
+{
+    std::size_t length;
+    if (addr.is_v4() || addr.to_v6().is_v4_mapped())
+    {
+        auto ip = addr.is_v4() ? addr.to_v4() : boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, addr.to_v6());
+        auto bytes = ip.to_bytes();
+        p[0] = socks5_atyp_ipv4;
+        std::copy(bytes.begin(), bytes.end(), p + 1);
+        length = 1 + 4 + 2;
+    }
+    else
+    {
+        auto bytes = addr.to_v6().to_bytes();
+        p[0] = socks5_atyp_ipv6;
+        std::copy(bytes.begin(), bytes.end(), p + 1);
+        length = 1 + 16 + 2;
+    }
+    p[length - 2] = port >> 8;
+    p[length - 1] = port & 0xff;
+    return length;
+}
+
+class udp_association;
+
+//recvmmsg/sendmmsg datagram engine of one event loop. all UDP associations
+//of the loop take client datagrams on the engine's socket, a flow table keyed
+//by client endpoint hands each one to its association. datagrams move up to
+//--udp-batch per syscall in both directions, through one scratch batch that
+//is only used inside a single handler. associations idle for
+//--udp-idle-timeout are expired by their timer on the loop's timing wheel.
+class udp_engine
+{
+public:
+    enum
+    {
+        max_batch = 64,
+        //full batches read back to back per wakeup, before waiting again
+        max_rounds = 16,
+        max_datagram = 65535,
+        //RSV, FRAG, ATYP, IPv6 address, port: the largest header put in front of a reply
+        header_room = 2 + 1 + 1 + 16 + 2
+    };
+    struct slot
+    {
+        u_char data[header_room + max_datagram];
+        sockaddr_storage addr;
+        iovec iov;
+    };
+
+    udp_engine(boost::asio::io_context &io_context) : socket_(io_context) {}
+
+    //opened on the first association, on the wildcard address so one socket
+    //serves clients whatever local address they reached the proxy on
+    void open(boost::system::error_code &ec)
+    {
+        if (socket_.is_open())
+            return;
+        socket_.open(udp::v4(), ec);
+        if (!ec)
+            socket_.bind(udp::endpoint(udp::v4(), 0), ec);
+        if (!ec)
+            socket_.non_blocking(true, ec);
+        if (ec)
+        {
+            boost::system::error_code ignored;
+            socket_.close(ignored);
+            return;
+        }
+        slots_.reset(new slot[max_batch]);
+        do_read();
+    }
+    u_short port() const
+    {
+        boost::system::error_code ec;
+        return socket_.local_endpoint(ec).port();
+    }
+
+    //a client port of 0 is learned from the first datagram of that address
+    void add(udp_association *a, const udp::endpoint &client)
+    {
+        if (client.port())
+            flows_[client] = a;
+        else
+            pending_.emplace(client.address(), a);
+    }
+    void remove(udp_association *a, const udp::endpoint &client);
+
+    //replies of one association, already addressed to its client
+    void send(mmsghdr *msgs, unsigned n)
+    {
+        while (n)
+        {
+            int sent = sendmmsg(socket_.native_handle(), msgs, n, MSG_DONTWAIT);
+            if (sent < 0)
+            {
+                //a full send buffer drops the rest, as the network would
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return;
+                //anything else, e.g. an unreachable client, only costs
+                //the datagram it failed on
+                if (errno != EINTR)
+                {
+                    msgs++;
+                    n--;
+                }
+                continue;
+            }
+            msgs += sent;
+            n -= sent;
+        }
+    }
+    slot *slots()
+    {
+        return slots_.get();
+    }
+    mmsghdr *msgs()
+    {
+        return msgs_;
+    }
+
+private:
+    udp::socket socket_;
+    std::unique_ptr<slot[]> slots_;
+    mmsghdr msgs_[max_batch];
+    //per datagram of the batch being forwarded: its association and destination
+    udp_association *owner_[max_batch];
+    udp::endpoint to_[max_batch];
+    std::unordered_map<udp::endpoint, udp_association *, address_hash> flows_;
+    std::unordered_multimap<boost::asio::ip::address, udp_association *, address_hash> pending_;
+
+    void do_read()
+    {
+        socket_.async_wait(udp::socket::wait_read, [this](boost::system::error_code ec) {
+            if (ec)
+                return;
+            for (int round = 0; round < max_rounds && receive() == options.udp_batch; round++)
+                ;
+            do_read();
+        });
+    }
+
+    unsigned receive();
+    udp_association *lookup(const udp::endpoint &from);
+};
+
+//the host side of a SOCKS5 UDP ASSOCIATE: its control connection and a
+//remote socket. datagrams from the client carry a SOCKS5 header naming their
+//destination and leave through the remote socket, replies go back through
+//the loop's udp_engine wrapped in a header naming their source. the
+//association ends with the control connection or after idling.
+class udp_association
+    : public std::enable_shared_from_this<udp_association>
+{
+public:
+    udp_association(tcp::socket control, udp::socket remote, const udp::endpoint &client_ep,
+                    udp_engine &engine, timing_wheel &wheel, const access_record &record,
+                    shared_ptr<admission::ticket> ticket)
+        : control_(std::move(control)), remote_(std::move(remote)), client_ep_(client_ep),
+          engine_(engine), wheel_(wheel), record_(record), ticket_(std::move(ticket))
+    {
+        boost::system::error_code ec;
+        remote_v6_ = remote_.local_endpoint(ec).protocol() == udp::v6();
+    }
+    ~udp_association()
+    {
+        engine_.remove(this, client_ep_);
+        metrics::add(metrics::local().tunnels_closed);
+        record_.duration = std::chrono::steady_clock::now() - record_.started;
+        access_log.write(record_);
+    }
+    void start()
+    {
+        metrics::add(metrics::local().tunnels_opened);
+        engine_.add(this, client_ep_);
+        touch();
+        watch_control();
+        remote_read();
+    }
+
+    const udp::endpoint &client() const
+    {
+        return client_ep_;
+    }
+    void set_client(const udp::endpoint &ep)
+    {
+        client_ep_ = ep;
+    }
+    //parses a client datagram in place. sets its destination and the length
+    //of its header, or returns false if it is dropped or sent later
+    bool route(const u_char *p, std::size_t length, const firewall_rules &rules, udp::endpoint &to, std::size_t &header)
+    {
+        touch();
+        //RSV, FRAG; fragments are not supported and dropped
+        if (length < 3 || p[2] != 0)
+            return false;
+        socks5_address dst;
+        header = parse_socks5_address(p + 3, length - 3, dst);
+        if (header == 0 || header == std::size_t(-1))
+            return false;
+        header += 3;
+        if (!dst.domain.empty())
+        {
+            resolve_and_send(dst, p + header, length - header);
+            return false;
+        }
+        to = udp::endpoint(dst.addr, dst.port);
+        return permit(rules, to);
+    }
+
+    //the batch's datagrams for this association, in arrival order
+    void send(mmsghdr *msgs, unsigned n)
+    {
+        while (n)
+        {
+            int sent = sendmmsg(remote_.native_handle(), msgs, n, MSG_DONTWAIT);
+            if (sent < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return;
+                //a pending ICMP error or an unreachable destination fails
+                //one datagram, the others still go out
+                if (errno != EINTR)
+                {
+                    msgs++;
+                    n--;
+                }
+                continue;
+            }
+            for (int i = 0; i < sent; i++)
+                count(0, msgs[i].msg_len);
+            msgs += sent;
+            n -= sent;
+        }
+    }
+
+private:
+    tcp::socket control_;
+    udp::socket remote_;
+    bool remote_v6_ = false;
+    //the client's address is fixed by the control connection, its port by
+    //the request or else the first datagram
+    udp::endpoint client_ep_;
+    udp_engine &engine_;
+    timing_wheel &wheel_;
+    timing_wheel::timer idle_{[this] { stop("idle", boost::asio::error::timed_out); }};
+    u_char control_buffer_[64];
+    bool closed_ = false;
+    access_record record_;
+    shared_ptr<admission::ticket> ticket_;
+    live_connection live_;
+
+    void touch()
+    {
+        idle_.expires_after(wheel_, options.udp_idle_timeout);
+    }
+
+    //anything on the control connection but its end is ignored
+    void watch_control()
+    {
+        auto self(shared_from_this());
+        control_.async_read_some(boost::asio::buffer(control_buffer_),
+                                 [this, self](boost::system::error_code ec, std::size_t /*length*/) {
+                                     if (ec)
+                                         stop(ec == boost::asio::error::eof ? nullptr : "control", ec);
+                                     else
+                                         watch_control();
+                                 });
+    }
+
+    bool permit(const firewall_rules &rules, udp::endpoint &to)
+    {
+        if (!rules.permit(socks5_connect, to.address()))
+            return false;
+        if (remote_v6_ && to.address().is_v4())
+            to.address(boost::asio::ip::make_address_v6(boost::asio::ip::v4_mapped, to.address().to_v4()));
+        else if (!remote_v6_ && to.address().is_v6())
+            return false;
+        return true;
+    }
+
+    //the engine's batch is reused before the lookup completes, so the payload is copied
+    void resolve_and_send(const socks5_address &dst, const u_char *data, std::size_t length)
+    {
+        auto payload = std::make_shared<std::vector<u_char>>(data, data + length);
+        auto self(shared_from_this());
+        u_short port = dst.port;
+        dns.resolve(dst.domain.to_string(), remote_.get_executor(),
+                    [this, self, payload, port](boost::system::error_code ec, const dns_cache::addresses &addrs) {
+                        udp::endpoint to(addrs.empty() ? boost::asio::ip::address() : addrs[0], port);
+                        if (ec || closed_ || !permit(*std::atomic_load(&firewall_), to))
+                            return;
+                        remote_.send_to(boost::asio::buffer(*payload), to, 0, ec);
+                        if (!ec)
+                            count(0, payload->size());
+                    });
+    }
+
+    void remote_read()
+    {
+        auto self(shared_from_this());
+        remote_.async_wait(udp::socket::wait_read, [this, self](boost::system::error_code ec) {
+            if (ec)
+            {
+                stop("read", ec);
+                return;
+            }
+            for (int round = 0; round < udp_engine::max_rounds && to_client() == options.udp_batch; round++)
+                ;
+            remote_read();
+        });
+    }
+
+    //receives a batch straight into the engine's slots, leaving room for the
+    //header in front of every payload, and sends it on as one batch
+    unsigned to_client()
+    {
+        udp_engine::slot *slots = engine_.slots();
+        mmsghdr *msgs = engine_.msgs();
+        for (unsigned i = 0; i < options.udp_batch; i++)
+        {
+            slots[i].iov.iov_base = slots[i].data + udp_engine::header_room;
+            slots[i].iov.iov_len = udp_engine::max_datagram;
+            msgs[i].msg_hdr = msghdr();
+            msgs[i].msg_hdr.msg_name = &slots[i].addr;
+            msgs[i].msg_hdr.msg_namelen = sizeof(slots[i].addr);
+            msgs[i].msg_hdr.msg_iov = &slots[i].iov;
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(remote_.native_handle(), msgs, options.udp_batch, MSG_DONTWAIT, nullptr);
+        //nowhere to send them before the client's port is known
+        if (n <= 0 || client_ep_.port() == 0)
+            return std::max(n, 0);
+        touch();
+        for (int i = 0; i < n; i++)
+        {
+            udp::endpoint from;
+            std::memcpy(from.data(), &slots[i].addr, msgs[i].msg_hdr.msg_namelen);
+            u_char header[udp_engine::header_room];
+            std::size_t header_length = 3 + put_socks5_address(header + 3, from.address(), from.port());
+            header[0] = header[1] = header[2] = 0;
+            u_char *p = slots[i].data + udp_engine::header_room - header_length;
+            std::memcpy(p, header, header_length);
+            count(1, msgs[i].msg_len);
+            slots[i].iov.iov_base = p;
+            slots[i].iov.iov_len = header_length + msgs[i].msg_len;
+            msgs[i].msg_hdr.msg_name = client_ep_.data();
+            msgs[i].msg_hdr.msg_namelen = client_ep_.size();
+        }
+        engine_.send(msgs, n);
+        return n;
+    }
+
+    void count(int direction, std::size_t length)
+    {
+        record_.bytes[direction] += length;
+        metrics::add(metrics::local().bytes[direction], length);
+    }
+
+    void stop(const char *what, boost::system::error_code ec)
+    {
+        if (closed_)
+            return;
+        closed_ = true;
+        if (what && ec != boost::asio::error::operation_aborted)
+        {
+            record_.stage = what;
+            record_.error = ec;
+        }
+        engine_.remove(this, client_ep_);
+        idle_.cancel();
+        boost::system::error_code ignored;
+        control_.close(ignored);
+        remote_.close(ignored);
+    }
+};
+
+inline void udp_engine::remove(udp_association *a, const udp::endpoint &client)
+{
+    auto flow = flows_.find(client);
+    if (flow != flows_.end() && flow->second == a)
+        flows_.erase(flow);
+    auto range = pending_.equal_range(client.address());
+    for (auto it = range.first; it != range.second; ++it)
+        if (it->second == a)
+        {
+            pending_.erase(it);
+            break;
+        }
+}
+
+inline udp_association *udp_engine::lookup(const udp::endpoint &from)
+{
+    auto flow = flows_.find(from);
+    if (flow != flows_.end())
+        return flow->second;
+    auto pending = pending_.find(from.address());
+    if (pending == pending_.end())
+        return nullptr;
+    udp_association *a = pending->second;
+    pending_.erase(pending);
+    a->set_client(from);
+    flows_[from] = a;
+    return a;
+}
+
+//a batch is routed datagram by datagram, then sent on grouped by association.
+//returns the number of datagrams received
+inline unsigned udp_engine::receive()
+{
+    unsigned batch = options.udp_batch;
+    for (unsigned i = 0; i < batch; i++)
+    {
+        slots_[i].iov.iov_base = slots_[i].data;
+        slots_[i].iov.iov_len = sizeof(slots_[i].data);
+        msgs_[i].msg_hdr = msghdr();
+        msgs_[i].msg_hdr.msg_name = &slots_[i].addr;
+        msgs_[i].msg_hdr.msg_namelen = sizeof(slots_[i].addr);
+        msgs_[i].msg_hdr.msg_iov = &slots_[i].iov;
+        msgs_[i].msg_hdr.msg_iovlen = 1;
+    }
+    int n = recvmmsg(socket_.native_handle(), msgs_, batch, MSG_DONTWAIT, nullptr);
+    if (n <= 0)
+        return 0;
+    auto rules = std::atomic_load(&firewall_);
+    unsigned routed = 0;
+    for (int i = 0; i < n; i++)
+    {
+        udp::endpoint from;
+        std::memcpy(from.data(), &slots_[i].addr, msgs_[i].msg_hdr.msg_namelen);
+        udp_association *a = lookup(from);
+        std::size_t header;
+        if (!a || !a->route(slots_[i].data, msgs_[i].msg_len, *rules, to_[routed], header))
+            continue;
+        slots_[i].iov.iov_base = slots_[i].data + header;
+        slots_[i].iov.iov_len = msgs_[i].msg_len - header;
+        mmsghdr &m = msgs_[routed];
+        m.msg_hdr = msghdr();
+        m.msg_hdr.msg_name = to_[routed].data();
+        m.msg_hdr.msg_namelen = to_[routed].size();
+        m.msg_hdr.msg_iov = &slots_[i].iov;
+        m.msg_hdr.msg_iovlen = 1;
+        owner_[routed++] = a;
+    }
+    //stable, so every association's datagrams keep their order
+    unsigned order[max_batch];
+    std::iota(order, order + routed, 0);
+    std::stable_sort(order, order + routed,
+                     [this](unsigned x, unsigned y) { return std::less<udp_association *>()(owner_[x], owner_[y]); });
+    mmsghdr grouped[max_batch];
+    for (unsigned i = 0; i < routed; i++)
+        grouped[i] = msgs_[order[i]];
+    for (unsigned start = 0, end; start < routed; start = end)
+    {
+        udp_association *a = owner_[order[start]];
+        for (end = start + 1; end < routed && owner_[order[end]] == a; end++)
+            ;
+        a->send(grouped + start, end - start);
+    }
+    return n;
+}
+
+//connects to every candidate address RFC 8305 style: a new attempt starts
+//every --connect-stagger or as soon as the previous one failed, the first
+//connected socket wins and all other attempts are cancelled.
+class connect_race
+    : public std::enable_shared_from_this<connect_race>
+{
+public:
+    typedef tcp::socket::executor_type executor;
+    typedef std::function<void(boost::system::error_code, tcp::socket &, const tcp::endpoint &)> handler;
+
+    enum
+    {
+        none = std::size_t(-1)
+    };
+
+    //profile, if any, is applied to every attempt before it connects
+    connect_race(executor ex, const std::vector<tcp::endpoint> &candidates, const socket_profile *profile, handler h)
+        : executor_(ex), candidates_(candidates), profile_(profile), handler_(std::move(h)), timer_(ex)
+    {}
+    void start()
+    {
+        start_attempt();
+    }
+    void cancel()
+    {
+        finish(boost::asio::error::operation_aborted, none);
+    }
+
+private:
+    executor executor_;
+    std::vector<tcp::endpoint> candidates_;
+    const socket_profile *profile_;
+    handler handler_;
+    boost::asio::steady_timer timer_;
+    std::vector<std::unique_ptr<tcp::socket>> attempts_;
+    std::size_t pending_ = 0;
+    bool done_ = false;
+    boost::system::error_code last_error_ = boost::asio::error::host_unreachable;
+
+    void start_attempt()
+    {
+        std::size_t i = attempts_.size();
+        if (done_ || i == candidates_.size())
+            return;
+        attempts_.emplace_back(new tcp::socket(executor_));
+        if (profile_)
+        {
+            //a failed open is retried, and reported, by async_connect
+            boost::system::error_code ec;
+            attempts_[i]->open(candidates_[i].protocol(), ec);
+            if (!ec)
+                profile_->apply(attempts_[i]->native_handle());
+        }
+        pending_++;
+        auto self(shared_from_this());
+        attempts_[i]->async_connect(candidates_[i], [this, self, i](boost::system::error_code ec) {
+            pending_--;
+            if (done_)
+                return;
+            if (!ec)
+            {
+                finish(ec, i);
+                return;
+            }
+            last_error_ = ec;
+            if (attempts_.size() < candidates_.size())
+                start_attempt();
+            else if (pending_ == 0)
+                finish(last_error_, none);
+        });
+
+        if (attempts_.size() < candidates_.size())
+        {
+            timer_.expires_after(options.connect_stagger);
+            timer_.async_wait([this, self](boost::system::error_code ec) {
+                if (!ec)
+                    start_attempt();
+            });
+        }
+    }
+
+    void finish(boost::system::error_code ec, std::size_t winner)
+    {
+        if (done_)
+            return;
+        done_ = true;
+        timer_.cancel();
+        boost::system::error_code ignored;
+        for (std::size_t i = 0; i < attempts_.size(); i++)
+            if (i != winner)
+                attempts_[i]->close(ignored);
+        //the handler holds its owner, which holds this race: drop it on
+        //every path or a cancelled race keeps the session alive for good
+        handler h(std::move(handler_));
+        handler_ = nullptr;
+        if (ec == boost::asio::error::operation_aborted)
+            return;
+        if (winner == none)
+        {
+            tcp::socket unused(executor_);
+            h(ec, unused, tcp::endpoint());
+        }
+        else
+            h(ec, *attempts_[winner], candidates_[winner]);
+    }
+};
+
+//idle pre-connected upstream sockets for the --prewarm destinations. each
+//event loop has its own pool, so a tunnel never crosses loops, and every
+//socket taken is replaced right away.
+class prewarm_pool
+{
+public:
+    prewarm_pool(boost::asio::io_context &io_context) : io_context_(io_context) {}
+
+    void start()
+    {
+        for (const auto &ep : options.prewarm)
+            for (unsigned i = 0; i < options.prewarm_size; i++)
+                connect_one(ep);
+    }
+
+    bool take(const std::vector<tcp::endpoint> &candidates, tcp::socket &out, tcp::endpoint &ep)
+    {
+        for (const auto &candidate : candidates)
+        {
+            auto it = idle_.find(candidate);
+            if (it == idle_.end() || it->second.empty())
+                continue;
+            auto sock = it->second.front();
+            it->second.pop_front();
+            connect_one(candidate);
+            //stop watching before handing the socket over
+            boost::system::error_code ec;
+            sock->cancel(ec);
+            out = std::move(*sock);
+            ep = candidate;
+            hits_++;
+            return true;
+        }
+        return false;
+    }
+
+private:
+    boost::asio::io_context &io_context_;
+    std::map<tcp::endpoint, std::deque<shared_ptr<tcp::socket>>> idle_;
+    uint64_t hits_ = 0;
+
+    void connect_one(const tcp::endpoint &ep)
+    {
+        auto sock = std::make_shared<tcp::socket>(io_context_);
+        sock->async_connect(ep, [this, ep, sock](boost::system::error_code ec) {
+            if (ec)
+            {
+                retry_later(ep);
+                return;
+            }
+            idle_[ep].push_back(sock);
+            watch(ep, sock);
+        });
+    }
+
+    void retry_later(const tcp::endpoint &ep)
+    {
+        auto timer = std::make_shared<boost::asio::steady_timer>(io_context_, std::chrono::seconds(1));
+        timer->async_wait([this, ep, timer](boost::system::error_code ec) {
+            if (!ec)
+                connect_one(ep);
+        });
+    }
+
+    //an idle socket the upstream closed is dropped and replaced
+    void watch(const tcp::endpoint &ep, shared_ptr<tcp::socket> sock)
+    {
+        sock->async_wait(tcp::socket::wait_read, [this, ep, sock](boost::system::error_code ec) {
+            if (ec == boost::asio::error::operation_aborted)
+                return;
+            char c;
+            if (!ec && ::recv(sock->native_handle(), &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0)
+                return; //server speaks first, the data waits in the socket for the client
+            auto &list = idle_[ep];
+            auto it = std::find(list.begin(), list.end(), sock);
+            if (it == list.end())
+                return;
+            list.erase(it);
+            sock->close(ec);
+            retry_later(ep);
+        });
+    }
+};
+
+//connections to the parent proxies of the forward rules. each event loop
+//keeps its own idle connections to every parent, SOCKS5 ones already past
+//the method negotiation, and counts the tunnels it runs through each. a
+//parent whose connect or handshake fails is down until a probe, once a
+//second, connects again; tunnels go to the parent of their group with the
+//fewest outstanding tunnels, preferring parents that are up.
+class parent_pool
+{
+public:
+    struct parent
+    {
+        parent_proxy proxy;
+        std::deque<shared_ptr<tcp::socket>> idle;
+        unsigned connecting = 0;
+        unsigned outstanding = 0;
+        bool up = true;
+        //a probe or refill is scheduled
+        bool waiting = false;
+        //no longer in the rules, connects still pending just close their socket
+        bool removed = false;
+    };
+
+    parent_pool(boost::asio::io_context &io_context) : io_context_(io_context) {}
+
+    //opens pools to the parents of rules, closes those of parents no longer listed
+    void configure(const firewall_rules &rules)
+    {
+        auto current = rules.parents();
+        for (auto it = parents_.begin(); it != parents_.end();)
+        {
+            if (std::binary_search(current.begin(), current.end(), it->first))
+            {
+                ++it;
+                continue;
+            }
+            it->second->removed = true;
+            close_idle(*it->second);
+            it = parents_.erase(it);
+        }
+        for (const auto &proxy : current)
+            get(proxy);
+    }
+
+    //the parent of group to try next, null once all are tried. SOCKS4
+    //parents cannot take IPv6 destinations
+    shared_ptr<parent> pick(const std::vector<parent_proxy> &group, const std::vector<shared_ptr<parent>> &tried,
+                            const boost::asio::ip::address &dst)
+    {
+        bool v6 = dst.is_v6() && !dst.to_v6().is_v4_mapped();
+        shared_ptr<parent> best;
+        //ties go round robin
+        for (std::size_t i = 0; i < group.size(); i++)
+        {
+            const auto &proxy = group[(next_ + i) % group.size()];
+            if (v6 && proxy.version == 4)
+                continue;
+            auto p = get(proxy);
+            if (std::find(tried.begin(), tried.end(), p) != tried.end())
+                continue;
+            if (!best || (p->up && !best->up) || (p->up == best->up && p->outstanding < best->outstanding))
+                best = p;
+        }
+        next_++;
+        return best;
+    }
+
+    //an idle connection to p; a SOCKS5 one has its method negotiated
+    bool take(const shared_ptr<parent> &p, tcp::socket &out)
+    {
+        if (p->idle.empty())
+            return false;
+        auto sock = p->idle.front();
+        p->idle.pop_front();
+        fill(p);
+        //stop watching before handing the socket over
+        boost::system::error_code ec;
+        sock->cancel(ec);
+        out = std::move(*sock);
+        return true;
+    }
+
+    //a connect or handshake through p failed
+    void failed(const shared_ptr<parent> &p)
+    {
+        if (p->removed)
+            return;
+        p->up = false;
+        close_idle(*p);
+        later(p);
+    }
+
+private:
+    boost::asio::io_context &io_context_;
+    std::map<parent_proxy, shared_ptr<parent>> parents_;
+    std::size_t next_ = 0;
+
+    shared_ptr<parent> get(const parent_proxy &proxy)
+    {
+        auto &p = parents_[proxy];
+        if (!p)
+        {
+            p = std::make_shared<parent>();
+            p->proxy = proxy;
+            fill(p);
+        }
+        return p;
+    }
+
+    void fill(const shared_ptr<parent> &p)
+    {
+        while (p->up && !p->removed && p->idle.size() + p->connecting < options.parent_pool_size)
+            connect_one(p);
+    }
+
+    //probes a parent that is down, refills one that is up
+    void later(const shared_ptr<parent> &p)
+    {
+        if (p->waiting)
+            return;
+        p->waiting = true;
+        auto timer = std::make_shared<boost::asio::steady_timer>(io_context_, std::chrono::seconds(1));
+        timer->async_wait([this, p, timer](boost::system::error_code) {
+            p->waiting = false;
+            if (p->removed)
+                return;
+            if (p->up)
+                fill(p);
+            else
+                connect_one(p);
+        });
+    }
+
+    void connect_one(const shared_ptr<parent> &p)
+    {
+        p->connecting++;
+        auto sock = std::make_shared<tcp::socket>(io_context_);
+        sock->async_connect(p->proxy.ep, [this, p, sock](boost::system::error_code ec) {
+            if (ec || p->proxy.version == 4)
+            {
+                connected(p, sock, ec);
+                return;
+            }
+            static const u_char greeting[] = {5, 1, socks5_no_auth};
+            boost::asio::async_write(*sock, boost::asio::buffer(greeting), [this, p, sock](boost::system::error_code ec, std::size_t) {
+                if (ec)
+                {
+                    connected(p, sock, ec);
+                    return;
+                }
+                auto reply = std::make_shared<std::array<u_char, 2>>();
+                boost::asio::async_read(*sock, boost::asio::buffer(*reply), [this, p, sock, reply](boost::system::error_code ec, std::size_t) {
+                    if (!ec && ((*reply)[0] != 5 || (*reply)[1] != socks5_no_auth))
+                        ec = boost::asio::error::connection_refused;
+                    connected(p, sock, ec);
+                });
+            });
+        });
+    }
+
+    void connected(const shared_ptr<parent> &p, const shared_ptr<tcp::socket> &sock, boost::system::error_code ec)
+    {
+        p->connecting--;
+        if (p->removed)
+            return;
+        if (ec)
+        {
+            failed(p);
+            return;
+        }
+        p->up = true;
+        if (p->idle.size() >= options.parent_pool_size)
+            return;
+        p->idle.push_back(sock);
+        watch(p, sock);
+        fill(p);
+    }
+
+    //parents never speak first: an idle connection that turns readable was
+    //closed or is broken, it is dropped and replaced a second later
+    void watch(const shared_ptr<parent> &p, const shared_ptr<tcp::socket> &sock)
+    {
+        sock->async_wait(tcp::socket::wait_read, [this, p, sock](boost::system::error_code ec) {
+            if (ec == boost::asio::error::operation_aborted)
+                return;
+            auto it = std::find(p->idle.begin(), p->idle.end(), sock);
+            if (it == p->idle.end())
+                return;
+            p->idle.erase(it);
+            sock->close(ec);
+            later(p);
+        });
+    }
+
+    static void close_idle(parent &p)
+    {
+        boost::system::error_code ec;
+        for (auto &sock : p.idle)
+            sock->close(ec);
+        p.idle.clear();
+    }
+};
+
+//held by a tunnel for as long as it runs through a parent
+class parent_lease
+{
+public:
+    explicit parent_lease(shared_ptr<parent_pool::parent> p) : parent_(std::move(p))
+    {
+        parent_->outstanding++;
+    }
+    parent_lease(const parent_lease &) = delete;
+    parent_lease &operator=(const parent_lease &) = delete;
+    ~parent_lease()
+    {
+        parent_->outstanding--;
+    }
+
+private:
+    shared_ptr<parent_pool::parent> parent_;
+};
+
+//--bind-ports: listeners for BIND opened once at startup instead of one
+//per request. the ports are dealt round robin to the event loops; a loop
+//accepts on its ports all the time and hands every peer to the pending BIND
+//that expects its address on that port, other peers are closed. BINDs
+//expecting the same address get different ports, one expecting any address
+//gets a port of its own.
+class bind_manager
+{
+public:
+    typedef std::function<void(tcp::socket)> handler;
+
+    bind_manager(boost::asio::io_context &io_context) : io_context_(io_context) {}
+
+    void open(u_short port, boost::system::error_code &ec)
+    {
+        std::unique_ptr<listener> l(new listener{port, tcp::acceptor(io_context_), boost::asio::steady_timer(io_context_)});
+        tcp::endpoint ep(tcp::v4(), port);
+        l->acceptor.open(ep.protocol(), ec);
+        if (!ec)
+            l->acceptor.set_option(tcp::acceptor::reuse_address(true), ec);
+        if (!ec)
+            l->acceptor.bind(ep, ec);
+        if (!ec)
+            l->acceptor.listen(boost::asio::socket_base::max_listen_connections, ec);
+        if (ec)
+            return;
+        accept(*l);
+        by_port_[port] = l.get();
+        listeners_.push_back(std::move(l));
+    }
+
+    bool empty() const
+    {
+        return listeners_.empty();
+    }
+
+    //registers a BIND waiting for a peer from expect (unspecified: any
+    //address) and returns the port to announce, 0 if no port is free for it
+    u_short add(const boost::asio::ip::address &expect, handler h)
+    {
+        auto addr = normalize(expect);
+        bool any = addr.is_unspecified();
+        for (std::size_t i = 0; i < listeners_.size(); i++)
+        {
+            auto &l = *listeners_[next_++ % listeners_.size()];
+            if (any ? l.waiting > 0 : l.any || pending_.count(key{l.port, addr}))
+                continue;
+            pending_.emplace(key{l.port, addr}, std::move(h));
+            l.waiting++;
+            l.any = any;
+            return l.port;
+        }
+        return 0;
+    }
+
+    //a BIND that gave up, e.g. on its timeout
+    void cancel(u_short port, const boost::asio::ip::address &expect)
+    {
+        auto it = pending_.find(key{port, normalize(expect)});
+        if (it == pending_.end())
+            return;
+        //the handler may hold the last reference to the session cancelling it
+        auto h = std::make_shared<handler>(std::move(it->second));
+        boost::asio::post(io_context_, [h] {});
+        remove(it);
+    }
+
+    static boost::asio::ip::address normalize(const boost::asio::ip::address &addr)
+    {
+        if (addr.is_v6() && addr.to_v6().is_v4_mapped())
+            return boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, addr.to_v6());
+        if (addr.is_unspecified())
+            return boost::asio::ip::address_v4::any();
+        return addr;
+    }
+
+private:
+    struct listener
+    {
+        u_short port;
+        tcp::acceptor acceptor;
+        boost::asio::steady_timer retry;
+        //pending BINDs on this port, one of them for any address
+        unsigned waiting = 0;
+        bool any = false;
+    };
+    struct key
+    {
+        u_short port;
+        boost::asio::ip::address addr;
+
+        bool operator==(const key &o) const
+        {
+            return port == o.port && addr == o.addr;
+        }
+    };
+    struct key_hash
+    {
+        std::size_t operator()(const key &k) const
+        {
+            return address_hash()(k.addr) ^ (std::size_t(k.port) << 16);
+        }
+    };
+    typedef std::unordered_map<key, handler, key_hash> pending_map;
+
+    boost::asio::io_context &io_context_;
+    std::vector<std::unique_ptr<listener>> listeners_;
+    std::unordered_map<u_short, listener *> by_port_;
+    pending_map pending_;
+    std::size_t next_ = 0;
+
+    enum
+    {
+        retry_ms = 100
+    };
+
+    void accept(listener &l)
+    {
+        l.acceptor.async_accept([this, &l](boost::system::error_code ec, tcp::socket peer) {
+            if (ec == boost::asio::error::operation_aborted)
+                return;
+            if (!ec)
+            {
+                dispatch(l, std::move(peer));
+                accept(l);
+                return;
+            }
+            //e.g. out of descriptors: retrying at once would spin the loop
+            //and starve the tunnels it serves
+            l.retry.expires_after(std::chrono::milliseconds(retry_ms));
+            l.retry.async_wait([this, &l](boost::system::error_code ec) {
+                if (!ec && l.acceptor.is_open())
+                    accept(l);
+            });
+        });
+    }
+
+    void dispatch(listener &l, tcp::socket peer)
+    {
+        boost::system::error_code ec;
+        auto from = normalize(peer.remote_endpoint(ec).address());
+        if (ec)
+            return;
+        auto it = pending_.find(key{l.port, from});
+        if (it == pending_.end() && l.any)
+            it = pending_.find(key{l.port, boost::asio::ip::address_v4::any()});
+        //nobody waits for this peer, it is closed
+        if (it == pending_.end())
+            return;
+        auto h = std::move(it->second);
+        remove(it);
+        h(std::move(peer));
+    }
+
+    void remove(pending_map::iterator it)
+    {
+        auto &l = *by_port_[it->first.port];
+        l.waiting--;
+        if (it->first.addr.is_unspecified())
+            l.any = false;
+        pending_.erase(it);
+    }
+};
+
+//--cpu-affinity. every event loop is pinned to a CPU and its listener tells
+//the kernel which one (SO_INCOMING_CPU); a reuseport BPF program picks for
+//each new connection the listener whose loop runs on the CPU the connection's
+//packets arrive on, i.e. the one its NIC queue interrupts. all sockets of a
+//tunnel already stay on the loop that accepted the client, so the relay then
+//runs where the kernel handles its packets.
+class cpu_placement
+{
+public:
+    //"auto": every CPU the process may use, filling one NUMA node, and its
+    //physical cores before their SMT siblings, before the next; else a list
+    //such as 0-3,8
+    static bool parse(const string &spec, std::vector<int> &cpus)
+    {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+            return false;
+        if (spec != "auto")
+        {
+            if (!parse_list(spec, cpus))
+                return false;
+            for (int c : cpus)
+                if (!CPU_ISSET(c, &allowed))
+                {
+                    std::cerr << "CPU " << c << " is not available\n";
+                    return false;
+                }
+            return true;
+        }
+        std::vector<std::pair<int, int>> order;
+        std::map<int, int> node;
+        for (int n = 0; n < max_nodes; n++)
+        {
+            std::vector<int> list;
+            if (read_list("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist", list))
+                for (int c : list)
+                    node[c] = n;
+        }
+        for (int c = 0; c < CPU_SETSIZE; c++)
+        {
+            if (!CPU_ISSET(c, &allowed))
+                continue;
+            std::vector<int> siblings;
+            read_list("/sys/devices/system/cpu/cpu" + std::to_string(c) + "/topology/thread_siblings_list", siblings);
+            int rank = std::find(siblings.begin(), siblings.end(), c) - siblings.begin();
+            order.emplace_back(node[c] * CPU_SETSIZE * 2 + std::min(rank, 1) * CPU_SETSIZE + c, c);
+        }
+        std::sort(order.begin(), order.end());
+        for (auto &o : order)
+            cpus.push_back(o.second);
+        return !cpus.empty();
+    }
+
+    //-1 when not pinned
+    static int cpu_of(unsigned loop)
+    {
+        return options.cpus.empty() ? -1 : options.cpus[loop % options.cpus.size()];
+    }
+
+    //the calling thread
+    static void pin(int cpu)
+    {
+        if (cpu < 0)
+            return;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+
+    //fork mode: a child moves to the CPU its connection arrives on, if it is
+    //one of ours, else it may use all of them
+    static void follow(int fd)
+    {
+        int cpu = -1;
+        socklen_t length = sizeof(cpu);
+        getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (std::find(options.cpus.begin(), options.cpus.end(), cpu) != options.cpus.end())
+            CPU_SET(cpu, &set);
+        else
+            for (int c : options.cpus)
+                CPU_SET(c, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+
+    //listeners[i] is the i-th socket of the SO_REUSEPORT group and served on
+    //cpus[i]. connections arriving on another CPU are spread by CPU number
+    static void steer(const std::vector<int> &listeners, const std::vector<int> &cpus, boost::system::error_code &ec)
+    {
+        for (std::size_t i = 0; i < listeners.size(); i++)
+            if (setsockopt(listeners[i], SOL_SOCKET, SO_INCOMING_CPU, &cpus[i], sizeof(int)) != 0)
+            {
+                ec = boost::system::error_code(errno, boost::system::system_category());
+                return;
+            }
+        std::vector<sock_filter> code;
+        code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, uint32_t(SKF_AD_OFF + SKF_AD_CPU)));
+        for (std::size_t i = 0; i < listeners.size(); i++)
+            //the first listener of a CPU takes its connections
+            if (std::find(cpus.begin(), cpus.begin() + i, cpus[i]) == cpus.begin() + i)
+            {
+                code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, uint32_t(cpus[i]), 0, 1));
+                code.push_back(BPF_STMT(BPF_RET | BPF_K, uint32_t(i)));
+            }
+        code.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, uint32_t(listeners.size())));
+        code.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+        sock_fprog program = {(unsigned short)code.size(), code.data()};
+        //the program belongs to the group, any member can attach it
+        if (setsockopt(listeners[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) != 0)
+            ec = boost::system::error_code(errno, boost::system::system_category());
+    }
+
+private:
+    enum
+    {
+        max_nodes = 64
+    };
+
+    static bool parse_list(const string &spec, std::vector<int> &cpus)
+    {
+        std::vector<string> parts;
+        boost::split(parts, spec, boost::is_any_of(","));
+        for (auto &part : parts)
+        {
+            int low, high;
+            char end;
+            int n = std::sscanf(part.c_str(), "%d-%d%c", &low, &high, &end);
+            if (n == 1)
+                high = low;
+            else if (n != 2)
+                return false;
+            if (low < 0 || low > high || high >= CPU_SETSIZE)
+                return false;
+            for (int c = low; c <= high; c++)
+                cpus.push_back(c);
+        }
+        return !cpus.empty();
+    }
+    static bool read_list(const string &path, std::vector<int> &cpus)
+    {
+        std::ifstream in(path);
+        string line;
+        return std::getline(in, line) && parse_list(boost::trim_copy(line), cpus);
+    }
+};
+
+struct event_loop
+{
+    boost::asio::io_context io_context{1};
+    timing_wheel wheel{io_context};
+    prewarm_pool prewarm{io_context};
+    parent_pool parents{io_context};
+    bind_manager binds{io_context};
+    udp_engine udp{io_context};
+    //--io-uring, null where the kernel lacks it
+    std::unique_ptr<uring> ring;
+};
+std::vector<std::unique_ptr<event_loop>> loops;
+//the loop run by the calling thread, every loop has exactly one thread
+thread_local event_loop *this_loop = nullptr;
+
+class socks_sess
+    : public std::enable_shared_from_this<socks_sess>
+{
+public:
+    socks_sess(std::shared_ptr<tcp::socket> sock, shared_ptr<admission::ticket> ticket)
+        : cli_socket(sock), acceptor_(sock->get_executor()),
+          wheel_(this_loop->wheel), ticket_(std::move(ticket))
+    {}
+
+    void start(){
+        phase_start_ = std::chrono::steady_clock::now();
+        record_.start = std::chrono::system_clock::now();
+        record_.started = phase_start_;
+        boost::system::error_code ec;
+        record_.src = cli_socket->remote_endpoint(ec);
+        rules_ = std::atomic_load(&firewall_);
+        profile_ = rules_->default_profile();
+        if (profile_)
+            profile_->apply(cli_socket->native_handle());
+        set_deadline(options.handshake_timeout);
+        socks_read();
+    }
+
+private:
+    enum parse_result
+    {
+        parse_incomplete,
+        parse_ok,
+        //a complete SOCKS5 greeting, the request follows
+        parse_greeting,
+        //well formed but not served, the error reply is set
+        parse_unsupported,
+        parse_bad
+    };
+
+    shared_ptr<tcp::socket> cli_socket;
+    //same executor as the client side, so both relay directions stay on one loop
+    shared_ptr<tcp::socket> dst_socket = std::make_shared<tcp::socket>(cli_socket->get_executor());
+    tcp::acceptor acceptor_;
+    timing_wheel &wheel_;
+    //one timer serves every handshake phase, each phase just moves its expiry
+    timing_wheel::timer deadline_{[this] { fail("timeout", boost::system::error_code()); }};
+    //the admission slot, handed on to the tunnel
+    shared_ptr<admission::ticket> ticket_;
+    live_connection live_;
+    u_char data_[max_request_length] = {0};
+    std::size_t received_ = 0;
+    //bytes of data_ already handled, a SOCKS5 request follows its greeting
+    std::size_t consumed_ = 0;
+    //VER, REP, RSV, then ATYP, address and port of up to an IPv6 address
+    u_char reply_[3 + 1 + 16 + 2] = {0};
+    std::size_t reply_length_ = 0;
+    //4 or 5, set by the first byte the client sends
+    u_char version_ = 0;
+    bool greeted_ = false;
+    socks4_parser socks4_;
+    bool closed_ = false;
+    std::chrono::steady_clock::time_point phase_start_;
+    access_record record_;
+
+    u_char cd_ = 0;
+    tcp::endpoint dst_ep_;
+    //every address the destination resolved to, in connect order
+    std::vector<tcp::endpoint> candidates_;
+    shared_ptr<connect_race> race_;
+    //the rule set the request was checked against, it owns profile_ and forward_
+    shared_ptr<const firewall_rules> rules_;
+    const socket_profile *profile_ = nullptr;
+    //the parents of a forwarded CONNECT, the one in use and those tried
+    const std::vector<parent_proxy> *forward_ = nullptr;
+    shared_ptr<parent_pool::parent> parent_;
+    std::vector<shared_ptr<parent_pool::parent>> tried_;
+    boost::system::error_code parent_error_ = boost::asio::error::host_unreachable;
+    shared_ptr<parent_lease> lease_;
+    //greeting, request and reply exchanged with the parent
+    u_char parent_io_[2 + 4 + 1 + 255 + 2];
+    //a BIND waits for a peer from this address, on bind_port_ of the loop's
+    //bind_manager if it has one; the peer may arrive before the first reply is out
+    boost::asio::ip::address bind_peer_;
+    u_short bind_port_ = 0;
+    bool bind_replied_ = false;
+    bool bind_accepted_ = false;
+    //point into data_
+    boost::string_view usr_id_, domain_;
+
+    void end_phase(metrics::phase p)
+    {
+        auto now = std::chrono::steady_clock::now();
+        metrics::observe(p, now - phase_start_);
+        phase_start_ = now;
+    }
+
+    void set_deadline(std::chrono::steady_clock::duration timeout)
+    {
+        deadline_.expires_after(wheel_, timeout);
+    }
+
+    void fail(const char *stage, boost::system::error_code ec)
+    {
+        if (!record_.stage)
+        {
+            record_.stage = stage;
+            record_.error = ec;
+        }
+        close();
+    }
+
+    //a handshake that never reaches the relay is logged here, tunnels log themselves
+    void close()
+    {
+        boost::system::error_code ec;
+        if (!closed_)
+        {
+            record_.duration = std::chrono::steady_clock::now() - record_.started;
+            access_log.write(record_);
+        }
+        closed_ = true;
+        deadline_.cancel();
+        if (race_)
+        {
+            race_->cancel();
+            race_.reset();
+        }
+        if (bind_port_)
+        {
+            this_loop->binds.cancel(bind_port_, bind_peer_);
+            bind_port_ = 0;
+        }
+        acceptor_.close(ec);
+        cli_socket->close(ec);
+        dst_socket->close(ec);
+    }
+
+    //requests may arrive split across several reads, keep reading until one is complete
+    void socks_read(){
+        auto self(shared_from_this());
+        cli_socket->async_read_some(boost::asio::buffer(data_ + received_, max_request_length - received_),
+            [this, self](boost::system::error_code ec, std::size_t length){
+                if (ec)
+                {
+                    fail("request", ec);
+                    return;
+                }
+                received_ += length;
+                handle_request();
+            });
+    }
+
+    void handle_request()
+    {
+        auto self(shared_from_this());
+        switch (parse_request())
+        {
+        case parse_ok:
+            end_phase(metrics::phase_parse);
+            socks_protocol();
+            break;
+        case parse_greeting:
+            socks5_method();
+            break;
+        case parse_unsupported:
+            socks_reply([this, self] { fail("request", boost::asio::error::operation_not_supported); });
+            break;
+        case parse_incomplete:
+            if (received_ < max_request_length)
+            {
+                socks_read();
+                break;
+            }
+            //fall through
+        case parse_bad:
+            fail("request", boost::asio::error::invalid_argument);
+            break;
+        }
+    }
+
+    //only "no authentication" is offered, the request is parsed from the same buffer
+    void socks5_method()
+    {
+        const u_char *methods = data_ + 2, *methods_end = methods + data_[1];
+        bool no_auth = std::find(methods, methods_end, socks5_no_auth) != methods_end;
+        consumed_ = methods_end - data_;
+        greeted_ = true;
+        reply_[0] = 5;
+        reply_[1] = no_auth ? socks5_no_auth : socks5_no_acceptable_method;
+        reply_length_ = 2;
+        auto self(shared_from_this());
+        socks_reply([this, self, no_auth] {
+            if (no_auth)
+                handle_request();
+            else
+                fail("auth", boost::asio::error::no_permission);
+        });
+    }
+
+    void socks_reply(std::function<void()> next){
+        auto self(shared_from_this());
+        boost::asio::async_write(*cli_socket, boost::asio::buffer(reply_, reply_length_),
+            [this, self, next](boost::system::error_code ec, std::size_t write_len){
+                if (ec)
+                    fail("reply", ec);
+                else
+                    next();
+            });
+    }
+
+    //the reply in the client's protocol, SOCKS4 only tells granted from rejected
+    void set_reply(u_char code, const tcp::endpoint &bound = tcp::endpoint())
+    {
+        if (version_ == 4)
+        {
+            reply_[0] = 0;
+            reply_[1] = code == socks5_succeeded ? 90 : 91;
+            reply_[2] = bound.port() >> 8;
+            reply_[3] = bound.port() & 0xff;
+            boost::asio::ip::address_v4::bytes_type ip = {};
+            if (bound.address().is_v4())
+                ip = bound.address().to_v4().to_bytes();
+            std::copy(ip.begin(), ip.end(), reply_ + 4);
+            reply_length_ = 8;
+            return;
+        }
+        reply_[0] = 5;
+        reply_[1] = code;
+        reply_[2] = 0;
+        reply_length_ = 3 + put_socks5_address(reply_ + 3, bound.address(), bound.port());
+    }
+
+    static u_char connect_reply(boost::system::error_code ec)
+    {
+        if (ec == boost::asio::error::connection_refused)
+            return socks5_refused;
+        if (ec == boost::asio::error::network_unreachable)
+            return socks5_network_unreachable;
+        if (ec == boost::asio::error::host_unreachable)
+            return socks5_host_unreachable;
+        if (ec == boost::asio::error::timed_out)
+            return socks5_ttl_expired;
+        return socks5_general_failure;
+    }
+
+    //the version is told by the first byte, both parsers work in place on data_
+    parse_result parse_request()
+    {
+        if (received_ < 1)
+            return parse_incomplete;
+        version_ = data_[0];
+        if (version_ == 4)
+            return parse_socks4();
+        if (version_ == 5)
+            return greeted_ ? parse_socks5() : parse_socks5_greeting();
+        return parse_bad;
+    }
+
+    parse_result parse_socks4()
+    {
+        socks4_parsed request;
+        switch (socks4_.parse(data_, received_, request))
+        {
+        case socks4_incomplete:
+            return parse_incomplete;
+        case socks4_bad:
+            return parse_bad;
+        case socks4_unsupported:
+            set_reply(socks5_command_unsupported);
+            return parse_unsupported;
+        case socks4_complete:
+            break;
+        }
+        cd_ = request.cd;
+        dst_ep_ = tcp::endpoint(boost::asio::ip::address_v4(request.ip), request.port);
+        usr_id_ = request.user_id;
+        domain_ = request.domain;
+        return parse_ok;
+    }
+
+    //VER, NMETHODS, METHODS
+    parse_result parse_socks5_greeting()
+    {
+        if (received_ < 2 || received_ < 2u + data_[1])
+            return parse_incomplete;
+        return parse_greeting;
+    }
+
+    //VER, CMD, RSV, then ATYP, address and port
+    parse_result parse_socks5()
+    {
+        const u_char *p = data_ + consumed_;
+        std::size_t n = received_ - consumed_;
+        if (n < 3)
+            return parse_incomplete;
+        if (p[0] != 5)
+            return parse_bad;
+        cd_ = p[1];
+        socks5_address dst;
+        std::size_t length = parse_socks5_address(p + 3, n - 3, dst);
+        if (length == 0)
+            return parse_incomplete;
+        if (length == std::size_t(-1))
+        {
+            set_reply(socks5_address_unsupported);
+            return parse_unsupported;
+        }
+        domain_ = dst.domain;
+        dst_ep_ = tcp::endpoint(dst.domain.empty() ? dst.addr : boost::asio::ip::address_v4(), dst.port);
+        if (cd_ != socks5_connect && cd_ != socks5_bind && cd_ != socks5_udp_associate)
+        {
+            set_reply(socks5_command_unsupported);
+            return parse_unsupported;
+        }
+        return parse_ok;
+    }
+
+    void socks_protocol()
+    {
+        //the address of a UDP ASSOCIATE is where the client sends from, it is never resolved
+        if (domain_.empty() || is_udp_associate())
+        {
+            candidates_.push_back(dst_ep_);
+            check_request();
+            return;
+        }
+        auto self(shared_from_this());
+        set_deadline(options.handshake_timeout);
+        dns.resolve(domain_.to_string(), cli_socket->get_executor(),
+            [this, self](boost::system::error_code ec, const dns_cache::addresses &addrs) {
+                if (closed_)
+                    return;
+                end_phase(metrics::phase_resolve);
+                if (ec)
+                {
+                    set_reply(socks5_host_unreachable);
+                    socks_reply([this, self, ec] { fail("resolve", ec); });
+                    return;
+                }
+                //alternate the address families, starting with the resolver's first choice
+                std::vector<tcp::endpoint> first, second;
+                for (const auto &addr : addrs)
+                    (addr.is_v4() == addrs[0].is_v4() ? first : second).emplace_back(addr, dst_ep_.port());
+                for (std::size_t i = 0; i < std::max(first.size(), second.size()); i++)
+                {
+                    if (i < first.size())
+                        candidates_.push_back(first[i]);
+                    if (i < second.size())
+                        candidates_.push_back(second[i]);
+                }
+                dst_ep_ = candidates_[0];
+                check_request();
+            });
+    }
+
+    bool is_udp_associate() const
+    {
+        return version_ == 5 && cd_ == socks5_udp_associate;
+    }
+
+    //datagrams of a UDP association are checked one by one, against the connect rules
+    void check_request()
+    {
+        if (!is_udp_associate())
+        {
+            rules_ = std::atomic_load(&firewall_);
+            candidates_.erase(std::remove_if(candidates_.begin(), candidates_.end(),
+                                             [this](const tcp::endpoint &ep) { return !rules_->permit(cd_, ep.address()); }),
+                              candidates_.end());
+        }
+        bool permit = !candidates_.empty();
+        if (permit)
+            dst_ep_ = candidates_[0];
+        if (permit && !is_udp_associate())
+            select_profile();
+        end_phase(metrics::phase_firewall);
+        if (!permit)
+            metrics::add(metrics::local().firewall_rejects);
+        set_reply(permit ? socks5_succeeded : socks5_not_allowed);
+        record_.dst = dst_ep_;
+        record_.command = cd_ <= socks5_udp_associate ? cd_ : 0;
+        record_.verdict = permit ? access_record::verdict_accept : access_record::verdict_reject;
+
+        auto self(shared_from_this());
+        if (!permit)
+            socks_reply([this, self] { close(); });
+        else if (cd_ == socks5_connect)
+            do_connect();
+        else if (cd_ == socks5_bind)
+            do_bind();
+        else
+            do_udp_associate();
+    }
+
+    //the first permitted destination decides, the client side switches too
+    //if it differs from the default profile applied at accept
+    void select_profile()
+    {
+        int rule_profile = -1;
+        rules_->permit(cd_, dst_ep_.address(), &rule_profile);
+        auto profile = rules_->profile(rule_profile, dst_ep_.port());
+        if (profile && profile != profile_)
+            profile->apply(cli_socket->native_handle());
+        profile_ = profile;
+    }
+
+    void do_connect()
+    {
+        auto self(shared_from_this());
+        if (this_loop && (forward_ = rules_->forward(dst_ep_.address())))
+        {
+            set_deadline(options.connect_timeout);
+            next_parent();
+            return;
+        }
+        if (this_loop && this_loop->prewarm.take(candidates_, *dst_socket, dst_ep_))
+        {
+            if (profile_)
+                profile_->apply(dst_socket->native_handle());
+            end_phase(metrics::phase_connect);
+            record_.dst = dst_ep_;
+            boost::system::error_code ignored;
+            set_reply(socks5_succeeded, dst_socket->local_endpoint(ignored));
+            socks_reply([this, self] { start_relay(); });
+            return;
+        }
+        set_deadline(options.connect_timeout);
+        race_ = std::make_shared<connect_race>(cli_socket->get_executor(), candidates_, profile_,
+            [this, self](boost::system::error_code ec, tcp::socket &winner, const tcp::endpoint &ep) {
+                race_.reset();
+                end_phase(metrics::phase_connect);
+                if (ec)
+                {
+                    metrics::add(metrics::local().connect_errors);
+                    set_reply(connect_reply(ec));
+                    socks_reply([this, self, ec] { fail("connect", ec); });
+                    return;
+                }
+                *dst_socket = std::move(winner);
+                dst_ep_ = ep;
+                record_.dst = dst_ep_;
+                boost::system::error_code ignored;
+                set_reply(socks5_succeeded, dst_socket->local_endpoint(ignored));
+                socks_reply([this, self] { start_relay(); });
+            });
+        race_->start();
+    }
+
+    //the least loaded parent first, on failure the others. a pooled
+    //connection may have been closed by the parent meanwhile, so it is
+    //retried once fresh before the parent counts as failed
+    void next_parent()
+    {
+        parent_ = this_loop->parents.pick(*forward_, tried_, dst_ep_.address());
+        if (!parent_)
+        {
+            end_phase(metrics::phase_connect);
+            metrics::add(metrics::local().connect_errors);
+            set_reply(socks5_host_unreachable);
+            auto self(shared_from_this());
+            auto ec = parent_error_;
+            socks_reply([this, self, ec] { fail("parent", ec); });
+            return;
+        }
+        tried_.push_back(parent_);
+        if (!this_loop->parents.take(parent_, *dst_socket))
+        {
+            parent_connect();
+            return;
+        }
+        if (profile_)
+            profile_->apply(dst_socket->native_handle());
+        parent_request(true);
+    }
+
+    void parent_connect()
+    {
+        boost::system::error_code ec;
+        dst_socket->close(ec);
+        dst_socket->open(parent_->proxy.ep.protocol(), ec);
+        if (!ec && profile_)
+            profile_->apply(dst_socket->native_handle());
+        auto self(shared_from_this());
+        dst_socket->async_connect(parent_->proxy.ep, [this, self](boost::system::error_code ec) {
+            if (closed_)
+                return;
+            if (ec)
+                parent_failed(ec);
+            else
+                parent_request(false);
+        });
+    }
+
+    void parent_failed(boost::system::error_code ec)
+    {
+        parent_error_ = ec;
+        this_loop->parents.failed(parent_);
+        next_parent();
+    }
+
+    void parent_retry(bool pooled, boost::system::error_code ec)
+    {
+        if (pooled)
+            parent_connect();
+        else
+            parent_failed(ec);
+    }
+
+    //the CONNECT request to the parent, with the destination as resolved here
+    void parent_request(bool pooled)
+    {
+        bool socks4 = parent_->proxy.version == 4;
+        //pooled SOCKS5 connections have negotiated the method already
+        bool greet = !socks4 && !pooled;
+        std::size_t n = 0;
+        if (socks4)
+        {
+            const auto &addr = dst_ep_.address();
+            auto ip = (addr.is_v4() ? addr.to_v4() : boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, addr.to_v6())).to_bytes();
+            parent_io_[n++] = 4;
+            parent_io_[n++] = socks5_connect;
+            parent_io_[n++] = dst_ep_.port() >> 8;
+            parent_io_[n++] = dst_ep_.port() & 0xff;
+            std::copy(ip.begin(), ip.end(), parent_io_ + n);
+            n += 4;
+            parent_io_[n++] = 0;
+        }
+        else
+        {
+            if (greet)
+            {
+                parent_io_[n++] = 5;
+                parent_io_[n++] = 1;
+                parent_io_[n++] = socks5_no_auth;
+            }
+            parent_io_[n++] = 5;
+            parent_io_[n++] = socks5_connect;
+            parent_io_[n++] = 0;
+            n += put_socks5_address(parent_io_ + n, dst_ep_.address(), dst_ep_.port());
+        }
+        auto self(shared_from_this());
+        boost::asio::async_write(*dst_socket, boost::asio::buffer(parent_io_, n),
+            [this, self, socks4, greet, pooled](boost::system::error_code ec, std::size_t) {
+                if (closed_)
+                    return;
+                if (ec)
+                {
+                    parent_retry(pooled, ec);
+                    return;
+                }
+                //SOCKS5: the method reply, then VER REP RSV ATYP and the first address byte
+                std::size_t head = socks4 ? 8 : (greet ? 2 : 0) + 5;
+                boost::asio::async_read(*dst_socket, boost::asio::buffer(parent_io_, head),
+                    [this, self, socks4, greet, pooled](boost::system::error_code ec, std::size_t) {
+                        if (closed_)
+                            return;
+                        if (ec)
+                        {
+                            parent_retry(pooled, ec);
+                            return;
+                        }
+                        if (socks4)
+                        {
+                            if (parent_io_[0] != 0)
+                                parent_retry(pooled, boost::asio::error::invalid_argument);
+                            else
+                                parent_reply(parent_io_[1] == 90 ? socks5_succeeded : socks5_general_failure);
+                            return;
+                        }
+                        const u_char *reply = parent_io_ + (greet ? 2 : 0);
+                        std::size_t rest = reply[3] == socks5_atyp_ipv4 ? 4 - 1 + 2 :
+                                           reply[3] == socks5_atyp_ipv6 ? 16 - 1 + 2 :
+                                           reply[3] == socks5_atyp_domain ? reply[4] + 2 : 0;
+                        if ((greet && (parent_io_[0] != 5 || parent_io_[1] != socks5_no_auth)) || reply[0] != 5 || !rest)
+                        {
+                            parent_retry(pooled, boost::asio::error::invalid_argument);
+                            return;
+                        }
+                        u_char code = std::min<u_char>(reply[1], socks5_address_unsupported);
+                        //the bound address is not passed on, the client gets ours
+                        boost::asio::async_read(*dst_socket, boost::asio::buffer(parent_io_, rest),
+                            [this, self, code, pooled](boost::system::error_code ec, std::size_t) {
+                                if (closed_)
+                                    return;
+                                if (ec)
+                                    parent_retry(pooled, ec);
+                                else
+                                    parent_reply(code);
+                            });
+                    });
+            });
+    }
+
+    //the parent answered, a refusal is the destination's and final
+    void parent_reply(u_char code)
+    {
+        end_phase(metrics::phase_connect);
+        auto self(shared_from_this());
+        if (code != socks5_succeeded)
+        {
+            metrics::add(metrics::local().connect_errors);
+            set_reply(code);
+            socks_reply([this, self] { fail("parent", boost::asio::error::connection_refused); });
+            return;
+        }
+        lease_ = std::make_shared<parent_lease>(parent_);
+        boost::system::error_code ignored;
+        set_reply(socks5_succeeded, dst_socket->local_endpoint(ignored));
+        socks_reply([this, self] { start_relay(); });
+    }
+
+    void do_bind()
+    {
+        auto self(shared_from_this());
+        boost::system::error_code ec;
+        bind_peer_ = bind_manager::normalize(dst_ep_.address());
+        if (this_loop && !this_loop->binds.empty())
+            bind_port_ = this_loop->binds.add(bind_peer_, [this, self](tcp::socket peer) {
+                bind_port_ = 0;
+                *dst_socket = std::move(peer);
+                bind_accepted_ = true;
+                if (bind_replied_)
+                    bind_accepted();
+            });
+        if (bind_port_)
+        {
+            set_reply(socks5_succeeded, tcp::endpoint(cli_socket->local_endpoint(ec).address(), bind_port_));
+            set_deadline(options.bind_timeout);
+            socks_reply([this, self] {
+                bind_replied_ = true;
+                if (bind_accepted_)
+                    bind_accepted();
+            });
+            return;
+        }
+        //no --bind-ports, or every port already waits for this peer
+        acceptor_.open(tcp::v4(), ec);
+        if (!ec)
+            acceptor_.bind(tcp::endpoint(tcp::v4(), 0), ec);
+        if (!ec && profile_)
+            profile_->apply(acceptor_.native_handle());
+        if (!ec)
+            acceptor_.listen(boost::asio::socket_base::max_listen_connections, ec);
+        if (ec)
+        {
+            set_reply(socks5_general_failure);
+            socks_reply([this, self, ec] { fail("bind", ec); });
+            return;
+        }
+        //the address the client reached us on, with the listener's port
+        set_reply(socks5_succeeded, tcp::endpoint(cli_socket->local_endpoint(ec).address(), acceptor_.local_endpoint(ec).port()));
+
+        set_deadline(options.bind_timeout);
+        socks_reply([this, self] {
+            acceptor_.async_accept(*dst_socket, [this, self](boost::system::error_code ec) {
+                boost::system::error_code ignored;
+                acceptor_.close(ignored);
+                if (ec)
+                {
+                    set_reply(socks5_general_failure);
+                    socks_reply([this, self, ec] { fail("accept", ec); });
+                    return;
+                }
+                bind_accepted();
+            });
+        });
+    }
+
+    //the second reply, granted only to the peer the request named
+    void bind_accepted()
+    {
+        auto self(shared_from_this());
+        boost::system::error_code ignored;
+        auto peer = dst_socket->remote_endpoint(ignored);
+        if (!bind_peer_.is_unspecified() && bind_manager::normalize(peer.address()) != bind_peer_)
+        {
+            set_reply(socks5_not_allowed);
+            socks_reply([this, self] { fail("accept", boost::asio::error::access_denied); });
+            return;
+        }
+        if (profile_)
+            profile_->apply(dst_socket->native_handle());
+        set_reply(socks5_succeeded, peer);
+        socks_reply([this, self] { start_relay(); });
+    }
+
+    //clients send to the loop's udp_engine, each association gets its own
+    //dual-stack remote socket (IPv4 only where IPv6 is unavailable)
+    void do_udp_associate()
+    {
+        boost::system::error_code ec;
+        auto local = cli_socket->local_endpoint(ec).address();
+        auto remote = std::make_shared<udp::socket>(cli_socket->get_executor());
+        if (!this_loop)
+            ec = boost::asio::error::operation_not_supported;
+        if (!ec)
+            this_loop->udp.open(ec);
+        if (!ec)
+        {
+            boost::system::error_code v6_ec;
+            remote->open(udp::v6(), v6_ec);
+            if (!v6_ec)
+                remote->set_option(boost::asio::ip::v6_only(false), v6_ec);
+            if (!v6_ec)
+                remote->bind(udp::endpoint(udp::v6(), 0), v6_ec);
+            if (v6_ec)
+            {
+                remote->close(v6_ec);
+                remote->open(udp::v4(), ec);
+                if (!ec)
+                    remote->bind(udp::endpoint(udp::v4(), 0), ec);
+            }
+        }
+        auto self(shared_from_this());
+        if (ec)
+        {
+            set_reply(socks5_general_failure);
+            socks_reply([this, self, ec] { fail("udp", ec); });
+            return;
+        }
+        set_reply(socks5_succeeded, tcp::endpoint(local, this_loop->udp.port()));
+        socks_reply([this, self, remote] {
+            closed_ = true;
+            deadline_.cancel();
+            //datagrams are only taken from the client's own address
+            boost::system::error_code ec;
+            udp::endpoint client_ep(cli_socket->remote_endpoint(ec).address(), dst_ep_.port());
+            std::make_shared<udp_association>(std::move(*cli_socket), std::move(*remote), client_ep,
+                                              this_loop->udp, wheel_, record_, std::move(ticket_))
+                ->start();
+        });
+    }
+
+    void start_relay()
+    {
+        closed_ = true;
+        deadline_.cancel();
+        std::make_shared<tunnel>(std::move(*cli_socket), std::move(*dst_socket), record_, std::move(ticket_), wheel_,
+                                 this_loop->ring.get(), std::move(lease_))
+            ->start();
+    }
+};
+
+class server : private uring::operation
+{
+public:
+    //with a ring, one multishot accept replaces the async_accept loop.
+    //stats, if any, is the metrics listener a forked child closes too.
+    //listener >= 0: a socket taken over from the previous process
+    server(boost::asio::io_context &io_context, unsigned short port, uring *ring, metrics_server *stats, int listener = -1)
+        : io_context_(io_context), acceptor_(io_context), ring_(ring), stats_(stats), retry_(io_context)
+    {
+        if (listener >= 0)
+            acceptor_.assign(tcp::v4(), listener);
+        else
+        {
+            tcp::endpoint ep(tcp::v4(), port);
+            acceptor_.open(ep.protocol());
+            acceptor_.set_option(tcp::acceptor::reuse_address(true));
+            acceptor_.set_option(reuse_port(true));
+            acceptor_.bind(ep);
+            //accepted sockets inherit the buffer sizes, and with them the
+            //window scale of the handshake; keepalive and nodelay follow
+            //per connection
+            if (auto profile = std::atomic_load(&firewall_)->default_profile())
+                profile->apply(acceptor_.native_handle());
+            if (options.tcp_fastopen > 0)
+            {
+                int qlen = options.tcp_fastopen;
+                setsockopt(acceptor_.native_handle(), IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen));
+            }
+            acceptor_.listen();
+        }
+        if (ring_)
+            ring_->accept(acceptor_.native_handle(), this);
+        else
+            do_accept();
+    }
+
+    int native_handle()
+    {
+        return acceptor_.native_handle();
+    }
+
+    //stops accepting, from any thread. the listener itself stays open as
+    //long as another process holds it
+    void stop()
+    {
+        boost::asio::post(io_context_, [this] {
+            stopped_ = true;
+            if (ring_)
+                ring_->cancel(this);
+            boost::system::error_code ignored;
+            acceptor_.close(ignored);
+            retry_.cancel();
+        });
+    }
+
+    //fork mode: gives back the slots of exited children
+    void reap_children()
+    {
+        pid_t pid;
+        while ((pid = waitpid(-1, nullptr, WNOHANG)) > 0)
+            children_.erase(pid);
+    }
+
+private:
+    enum
+    {
+        retry_ms = 100
+    };
+
+    void do_accept()
+    {
+        auto socket_ = std::make_shared<tcp::socket>(io_context_);
+        acceptor_.async_accept(*socket_,
+                               [this, socket_](boost::system::error_code ec) {
+                                   if (ec)
+                                   {
+                                       if (ec != boost::asio::error::operation_aborted)
+                                           retry([this] { do_accept(); });
+                                       return;
+                                   }
+                                   if (accepted(socket_))
+                                       do_accept();
+                               });
+    }
+
+    void complete(int res, unsigned flags) override
+    {
+        if (res >= 0)
+        {
+            auto socket = std::make_shared<tcp::socket>(io_context_);
+            boost::system::error_code ec;
+            socket->assign(tcp::v4(), res, ec);
+            if (ec)
+                ::close(res);
+            else
+                accepted(socket);
+        }
+        if (flags & IORING_CQE_F_MORE || stopped_)
+            return;
+        //a multishot accept ends on an error such as EMFILE, which a new
+        //one would hit again right away
+        if (res < 0)
+            retry([this] { ring_->accept(acceptor_.native_handle(), this); });
+        else
+            ring_->accept(acceptor_.native_handle(), this);
+    }
+
+    //after an accept error, e.g. out of descriptors: trying again at once
+    //would spin the loop and starve the tunnels it serves
+    template <typename F>
+    void retry(F f)
+    {
+        retry_.expires_after(std::chrono::milliseconds(retry_ms));
+        retry_.async_wait([this, f](boost::system::error_code ec) {
+            if (!ec && !stopped_)
+                f();
+        });
+    }
+
+    //false in a forked child, which serves this client only
+    bool accepted(const shared_ptr<tcp::socket> &socket_)
+    {
+        metrics::add(metrics::local().accepts);
+        shared_ptr<admission::ticket> ticket;
+        if (admission_.enabled() && !(ticket = admit(*socket_)))
+            return true;
+        if (!options.fork_mode)
+        {
+            std::make_shared<socks_sess>(socket_, std::move(ticket))->start();
+            return true;
+        }
+        io_context_.notify_fork(boost::asio::execution_context::fork_prepare);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            io_context_.notify_fork(boost::asio::execution_context::fork_child);
+            //the child only serves this client, io_context.run() returns once it is done
+            acceptor_.close();
+            if (stats_)
+                stats_->stop();
+            children_.clear();
+            live_connection::child_context = &io_context_;
+            if (!options.cpus.empty())
+                cpu_placement::follow(socket_->native_handle());
+            std::make_shared<socks_sess>(socket_, std::move(ticket))->start();
+            return false;
+        }
+        io_context_.notify_fork(boost::asio::execution_context::fork_parent);
+        socket_->close();
+        //the parent holds the slot until the child is reaped
+        if (pid > 0 && ticket)
+            children_[pid] = std::move(ticket);
+        return true;
+    }
+    //a refused connection is closed right away, before any SOCKS exchange
+    shared_ptr<admission::ticket> admit(tcp::socket &socket)
+    {
+        boost::system::error_code ec;
+        access_record record;
+        record.src = socket.remote_endpoint(ec);
+        auto ticket = admission_.admit(record.src.address());
+        if (ticket)
+            return ticket;
+        metrics::add(metrics::local().admission_rejects);
+        record.start = std::chrono::system_clock::now();
+        record.started = std::chrono::steady_clock::now();
+        record.verdict = access_record::verdict_reject;
+        record.stage = "admission";
+        record.error = boost::asio::error::try_again;
+        access_log.write(record);
+        socket.close(ec);
+        return nullptr;
+    }
+
+    boost::asio::io_context &io_context_;
+    tcp::acceptor acceptor_;
+    uring *ring_;
+    metrics_server *stats_;
+    boost::asio::steady_timer retry_;
+    bool stopped_ = false;
+    std::unordered_map<pid_t, shared_ptr<admission::ticket>> children_;
+};
+
+//hot restart over a Unix socket at --handoff. a process started while
+//another one listens there takes over its listening sockets (SCM_RIGHTS)
+//instead of binding new ones. once it acknowledges them the old process
+//stops accepting and drains its connections for up to --drain-timeout.
+//the sockets, and the connections queued on them, are shared until the old
+//process closes its copies, so no connection is refused in between.
+class hot_restart
+{
+public:
+    enum
+    {
+        //SCM_MAX_FD
+        max_fds = 253,
+        ack = 'k'
+    };
+
+    //new process: the SOCKS listeners and the metrics listener, if any, of
+    //the server running at path. returns the connection to acknowledge
+    //them on, -1 on a cold start
+    static int take_over(const string &path, std::vector<int> &listeners, int &metrics_listener)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un addr;
+        if (fd < 0 || !make_address(path, addr) ||
+            connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+        {
+            if (fd >= 0)
+                ::close(fd);
+            return -1;
+        }
+        timeval timeout = {5, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        uint32_t counts[2];
+        iovec iov = {counts, sizeof(counts)};
+        char control[CMSG_SPACE(sizeof(int) * max_fds)];
+        msghdr msg = msghdr();
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        std::vector<int> fds;
+        if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) == sizeof(counts))
+            for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+                if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+                {
+                    fds.resize((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+                    std::memcpy(fds.data(), CMSG_DATA(c), fds.size() * sizeof(int));
+                }
+        if (fds.empty() || fds.size() != std::size_t(counts[0]) + counts[1])
+        {
+            for (int l : fds)
+                ::close(l);
+            ::close(fd);
+            return -1;
+        }
+        listeners.assign(fds.begin(), fds.begin() + counts[0]);
+        metrics_listener = counts[1] ? fds.back() : -1;
+        return fd;
+    }
+
+    //new process, once it accepts on the listeners: the old one stops and
+    //closes the connection when it no longer listens at the path
+    static void acknowledge(int fd)
+    {
+        char c = ack;
+        if (write(fd, &c, 1) == 1)
+            while (read(fd, &c, 1) > 0)
+                ;
+        ::close(fd);
+    }
+
+    hot_restart(boost::asio::io_context &io_context, const string &path,
+                std::vector<std::unique_ptr<server>> &servers, metrics_server *stats)
+        : acceptor_(io_context), connection_(io_context), drain_(io_context), servers_(servers), stats_(stats)
+    {
+        ::unlink(path.c_str());
+        boost::asio::local::stream_protocol::endpoint ep(path);
+        acceptor_.open(ep.protocol());
+        acceptor_.bind(ep);
+        acceptor_.listen();
+        do_accept();
+    }
+
+private:
+    boost::asio::local::stream_protocol::acceptor acceptor_;
+    boost::asio::local::stream_protocol::socket connection_;
+    boost::asio::steady_timer drain_;
+    std::chrono::steady_clock::time_point deadline_;
+    std::vector<std::unique_ptr<server>> &servers_;
+    metrics_server *stats_;
+    char ack_ = 0;
+
+    static bool make_address(const string &path, sockaddr_un &addr)
+    {
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+            return false;
+        std::memcpy(addr.sun_path, path.data(), path.size());
+        return true;
+    }
+
+    void do_accept()
+    {
+        acceptor_.async_accept(connection_, [this](boost::system::error_code ec) {
+            if (ec == boost::asio::error::operation_aborted)
+                return;
+            if (ec || !same_user() || !send_listeners())
+            {
+                connection_.close(ec);
+                do_accept();
+                return;
+            }
+            //a process that fails before acknowledging leaves this one in charge
+            boost::asio::async_read(connection_, boost::asio::buffer(&ack_, 1),
+                                    [this](boost::system::error_code ec, std::size_t) {
+                                        if (!ec && ack_ == ack)
+                                        {
+                                            hand_over();
+                                            return;
+                                        }
+                                        connection_.close(ec);
+                                        do_accept();
+                                    });
+        });
+    }
+
+    //the listeners only go to processes of the same user
+    bool same_user()
+    {
+        ucred cred;
+        socklen_t length = sizeof(cred);
+        return getsockopt(connection_.native_handle(), SOL_SOCKET, SO_PEERCRED, &cred, &length) == 0 &&
+               cred.uid == geteuid();
+    }
+
+    bool send_listeners()
+    {
+        std::vector<int> fds;
+        for (auto &s : servers_)
+            fds.push_back(s->native_handle());
+        if (stats_)
+            fds.push_back(stats_->native_handle());
+        if (fds.size() > max_fds)
+            return false;
+        uint32_t counts[2] = {uint32_t(servers_.size()), stats_ ? 1u : 0u};
+        iovec iov = {counts, sizeof(counts)};
+        char control[CMSG_SPACE(sizeof(int) * max_fds)];
+        msghdr msg = msghdr();
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+        cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        std::memcpy(CMSG_DATA(c), fds.data(), sizeof(int) * fds.size());
+        return sendmsg(connection_.native_handle(), &msg, MSG_NOSIGNAL) == sizeof(counts);
+    }
+
+    void hand_over()
+    {
+        boost::system::error_code ignored;
+        acceptor_.close(ignored);
+        for (auto &s : servers_)
+            s->stop();
+        if (stats_)
+            stats_->stop();
+        //the new process exports its own tunnels to the same place
+        top_tunnels.close();
+        connection_.close(ignored);
+        std::cerr << "listeners handed over, draining " << live_connection::count() << " connections\n";
+        deadline_ = std::chrono::steady_clock::now() + options.drain_timeout;
+        drain();
+    }
+
+    //leaves run() once the last connection is gone or the deadline passed
+    void drain()
+    {
+        if (live_connection::count() == 0 || std::chrono::steady_clock::now() >= deadline_)
+        {
+            for (auto &loop : loops)
+                loop->io_context.stop();
+            return;
+        }
+        drain_.expires_after(std::chrono::milliseconds(100));
+        drain_.async_wait([this](boost::system::error_code ec) {
+            if (!ec)
+                drain();
+        });
+    }
+};
+
+void print_stats()
+{
+    std::cerr << "[dns cache] entries: " << dns.size()
+              << " hits: " << dns.hits.load()
+              << " misses: " << dns.misses.load()
+              << " coalesced: " << dns.coalesced.load() << endl;
+}
+
+void usage()
+{
+    std::cerr << "Usage: socks_server [options] <port>\n"
+              << "  -t, --threads N  event loop threads (default: number of cores)\n"
+              << "  -f, --fork       fork a process per connection instead\n"
+              << "  -c, --config F   firewall rules, reloaded on SIGHUP (default: socks_conf)\n"
+              << "  -z, --splice     zero-copy relay with splice()\n"
+              << "  -m, --metrics P  serve prometheus metrics over HTTP on port P\n"
+              << "  --io-uring       accept and relay through io_uring instead of epoll (Linux 5.19+)\n"
+              << "  --handoff PATH   hot restart: take over the listeners of the server at PATH, then\n"
+              << "                   listen there to hand them on to the next one\n"
+              << "  --drain-timeout S  connections a replaced server still serves, at most S seconds (default: 30)\n"
+              << "  --uring-buffers N  provided receive buffers of 64 KiB per thread (default: 512)\n"
+              << "  -w, --prewarm H:P     keep connections to a hot destination open in advance (repeatable)\n"
+              << "  --prewarm-size N      pre-connected sockets per destination and thread (default: 2)\n"
+              << "  --parent-pool N       idle connections per parent proxy and thread (default: 2)\n"
+              << "  --connect-stagger MS  delay between connect attempts to different addresses (default: 250)\n"
+              << "  -l, --access-log F    access log file, - for stdout, off to disable (default: -)\n"
+              << "  --log-format text|jsonl  access log record format (default: text)\n"
+              << "  --dns-ttl S           SOCKS4a cache lifetime of resolved names (default: 60)\n"
+              << "  --dns-negative-ttl S  cache lifetime of failed lookups (default: 10)\n"
+              << "  --dns-cache-size N    max cached names (default: 4096)\n"
+              << "  --handshake-timeout S  close clients not done with their request after S seconds (default: 10)\n"
+              << "  --connect-timeout S   give up connecting to a destination after S seconds (default: 10)\n"
+              << "  --bind-timeout S      give up waiting for a BIND peer after S seconds (default: 120)\n"
+              << "  --bind-ports LO-HI    serve BIND on listeners opened once on these ports\n"
+              << "  --idle-timeout S      close tunnels idle for S seconds (default: never)\n"
+              << "  --udp-batch N         datagrams per recvmmsg/sendmmsg, 1 to 64 (default: 32)\n"
+              << "  --udp-idle-timeout S  close UDP associations idle for S seconds (default: 60)\n"
+              << "  --max-tunnels N       concurrent connections in total (default: unlimited)\n"
+              << "  --max-per-client N    concurrent connections per source address\n"
+              << "  --max-connect-rate N  new connections per second per source address\n"
+              << "  --tunnel-bandwidth B  relay bytes/s per tunnel and direction\n"
+              << "  --client-bandwidth B  relay bytes/s per source address and direction\n"
+              << "  --tcp-fastopen N      accept TCP Fast Open, with up to N pending requests\n"
+              << "  --top-tunnels F       export the busiest tunnels to file F, or unix:PATH as datagrams\n"
+              << "  --top-interval S      seconds between exports, and the window rates are taken over (default: 5)\n"
+              << "  --top-count N         tunnels per export (default: 20)\n"
+              << "  --tunnel-slots N      tunnels tracked per thread, more go unlisted (default: 4096)\n"
+              << "  --cpu-affinity auto|LIST  pin event loops to CPUs (e.g. 0-3,8) and accept each\n"
+              << "                   connection on the loop of the CPU its packets arrive on\n"
+              << "SIGHUP reloads the firewall rules, SIGUSR1 prints statistics to stderr.\n";
+}
+
+enum
+{
+    opt_dns_ttl = 256,
+    opt_io_uring,
+    opt_uring_buffers,
+    opt_handoff,
+    opt_drain_timeout,
+    opt_dns_negative_ttl,
+    opt_dns_cache_size,
+    opt_log_format,
+    opt_prewarm_size,
+    opt_parent_pool,
+    opt_connect_stagger,
+    opt_handshake_timeout,
+    opt_connect_timeout,
+    opt_bind_timeout,
+    opt_bind_ports,
+    opt_idle_timeout,
+    opt_udp_batch,
+    opt_udp_idle_timeout,
+    opt_max_tunnels,
+    opt_max_per_client,
+    opt_max_connect_rate,
+    opt_tunnel_bandwidth,
+    opt_client_bandwidth,
+    opt_tcp_fastopen,
+    opt_top_tunnels,
+    opt_top_interval,
+    opt_top_count,
+    opt_tunnel_slots,
+    opt_cpu_affinity
+};
+
+bool add_prewarm(const string &dest)
+{
+    std::size_t colon = dest.rfind(':');
+    if (colon == string::npos)
+        return false;
+    boost::asio::io_context io_context;
+    tcp::resolver resolver(io_context);
+    boost::system::error_code ec;
+    auto results = resolver.resolve(dest.substr(0, colon), dest.substr(colon + 1), ec);
+    if (ec)
+    {
+        std::cerr << "cannot resolve " << dest << ": " << ec.message() << "\n";
+        return false;
+    }
+    for (const auto &entry : results)
+        options.prewarm.push_back(entry.endpoint());
+    return true;
+}
+
+bool parse_options(int argc, char *argv[])
+{
+    static const struct option long_opts[] = {
+        {"threads", required_argument, nullptr, 't'},
+        {"fork", no_argument, nullptr, 'f'},
+        {"config", required_argument, nullptr, 'c'},
+        {"splice", no_argument, nullptr, 'z'},
+        {"metrics", required_argument, nullptr, 'm'},
+        {"access-log", required_argument, nullptr, 'l'},
+        {"prewarm", required_argument, nullptr, 'w'},
+        {"prewarm-size", required_argument, nullptr, opt_prewarm_size},
+        {"parent-pool", required_argument, nullptr, opt_parent_pool},
+        {"connect-stagger", required_argument, nullptr, opt_connect_stagger},
+        {"log-format", required_argument, nullptr, opt_log_format},
+        {"dns-ttl", required_argument, nullptr, opt_dns_ttl},
+        {"dns-negative-ttl", required_argument, nullptr, opt_dns_negative_ttl},
+        {"dns-cache-size", required_argument, nullptr, opt_dns_cache_size},
+        {"handshake-timeout", required_argument, nullptr, opt_handshake_timeout},
+        {"connect-timeout", required_argument, nullptr, opt_connect_timeout},
+        {"bind-timeout", required_argument, nullptr, opt_bind_timeout},
+        {"bind-ports", required_argument, nullptr, opt_bind_ports},
+        {"idle-timeout", required_argument, nullptr, opt_idle_timeout},
+        {"udp-batch", required_argument, nullptr, opt_udp_batch},
+        {"io-uring", no_argument, nullptr, opt_io_uring},
+        {"uring-buffers", required_argument, nullptr, opt_uring_buffers},
+        {"handoff", required_argument, nullptr, opt_handoff},
+        {"drain-timeout", required_argument, nullptr, opt_drain_timeout},
+        {"udp-idle-timeout", required_argument, nullptr, opt_udp_idle_timeout},
+        {"max-tunnels", required_argument, nullptr, opt_max_tunnels},
+        {"max-per-client", required_argument, nullptr, opt_max_per_client},
+        {"max-connect-rate", required_argument, nullptr, opt_max_connect_rate},
+        {"tunnel-bandwidth", required_argument, nullptr, opt_tunnel_bandwidth},
+        {"client-bandwidth", required_argument, nullptr, opt_client_bandwidth},
+        {"tcp-fastopen", required_argument, nullptr, opt_tcp_fastopen},
+        {"top-tunnels", required_argument, nullptr, opt_top_tunnels},
+        {"top-interval", required_argument, nullptr, opt_top_interval},
+        {"top-count", required_argument, nullptr, opt_top_count},
+        {"tunnel-slots", required_argument, nullptr, opt_tunnel_slots},
+        {"cpu-affinity", required_argument, nullptr, opt_cpu_affinity},
+        {nullptr, 0, nullptr, 0}};
+    int opt;
+    bool threads_given = false;
+    while ((opt = getopt_long(argc, argv, "t:fc:zm:l:w:", long_opts, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            options.threads = std::max(1, std::atoi(optarg));
+            threads_given = true;
+            break;
+        case 'f':
+            options.fork_mode = true;
+            break;
+        case 'c':
+            options.config_path = optarg;
+            break;
+        case 'z':
+            options.splice = true;
+            break;
+        case 'm':
+            options.metrics_port = std::atoi(optarg);
+            break;
+        case 'l':
+            options.access_log_path = optarg;
+            break;
+        case 'w':
+            if (!add_prewarm(optarg))
+                return false;
+            break;
+        case opt_prewarm_size:
+            options.prewarm_size = std::atoi(optarg);
+            break;
+        case opt_parent_pool:
+            options.parent_pool_size = std::max(0, std::atoi(optarg));
+            break;
+        case opt_connect_stagger:
+            options.connect_stagger = std::chrono::milliseconds(std::atoi(optarg));
+            break;
+        case opt_log_format:
+            if (string(optarg) != "text" && string(optarg) != "jsonl")
+                return false;
+            options.access_log_jsonl = string(optarg) == "jsonl";
+            break;
+        case opt_dns_ttl:
+            options.dns_ttl = std::chrono::seconds(std::atoi(optarg));
+            break;
+        case opt_dns_negative_ttl:
+            options.dns_negative_ttl = std::chrono::seconds(std::atoi(optarg));
+            break;
+        case opt_dns_cache_size:
+            options.dns_cache_size = std::max(1, std::atoi(optarg));
+            break;
+        case opt_handshake_timeout:
+            options.handshake_timeout = std::chrono::seconds(std::max(1, std::atoi(optarg)));
+            break;
+        case opt_connect_timeout:
+            options.connect_timeout = std::chrono::seconds(std::max(1, std::atoi(optarg)));
+            break;
+        case opt_bind_timeout:
+            options.bind_timeout = std::chrono::seconds(std::max(1, std::atoi(optarg)));
+            break;
+        case opt_bind_ports:
+        {
+            unsigned low, high;
+            if (std::sscanf(optarg, "%u-%u", &low, &high) != 2 || low == 0 || low > high || high > 65535)
+                return false;
+            options.bind_port_low = low;
+            options.bind_port_high = high;
+            break;
+        }
+        case opt_idle_timeout:
+            options.idle_timeout = std::chrono::seconds(std::max(0, std::atoi(optarg)));
+            break;
+        case opt_io_uring:
+            options.io_uring = true;
+            break;
+        case opt_uring_buffers:
+            options.uring_buffers = std::min(32768, std::max(1, std::atoi(optarg)));
+            break;
+        case opt_handoff:
+            options.handoff_path = optarg;
+            break;
+        case opt_drain_timeout:
+            options.drain_timeout = std::chrono::seconds(std::max(0, std::atoi(optarg)));
+            break;
+        case opt_udp_batch:
+            options.udp_batch = std::min<unsigned>(udp_engine::max_batch, std::max(1, std::atoi(optarg)));
+            break;
+        case opt_udp_idle_timeout:
+            options.udp_idle_timeout = std::chrono::seconds(std::max(1, std::atoi(optarg)));
+            break;
+        case opt_max_tunnels:
+            options.max_tunnels = std::atoi(optarg);
+            break;
+        case opt_max_per_client:
+            options.max_per_client = std::atoi(optarg);
+            break;
+        case opt_max_connect_rate:
+            options.max_connect_rate = std::atoi(optarg);
+            break;
+        case opt_tunnel_bandwidth:
+            options.tunnel_bandwidth = std::atoll(optarg);
+            break;
+        case opt_client_bandwidth:
+            options.client_bandwidth = std::atoll(optarg);
+            break;
+        case opt_tcp_fastopen:
+            options.tcp_fastopen = std::max(0, std::atoi(optarg));
+            break;
+        case opt_top_tunnels:
+            options.top_path = optarg;
+            break;
+        case opt_top_interval:
+            options.top_interval = std::chrono::seconds(std::max(1, std::atoi(optarg)));
+            break;
+        case opt_top_count:
+            options.top_count = std::max(1, std::atoi(optarg));
+            break;
+        case opt_tunnel_slots:
+            options.tunnel_slots = std::max(1, std::atoi(optarg));
+            break;
+        case opt_cpu_affinity:
+            options.cpus.clear();
+            if (!cpu_placement::parse(optarg, options.cpus))
+                return false;
+            break;
+        default:
+            return false;
+        }
+    }
+    if (optind != argc - 1)
+        return false;
+    options.port = std::atoi(argv[optind]);
+    //forked children would inherit the handoff socket and the parent's
+    //prewarmed sockets, which all of them would then share, and their tunnels
+    //are out of the parent's sight
+    if (options.fork_mode && (!options.handoff_path.empty() || !options.top_path.empty() || !options.prewarm.empty()))
+        return false;
+    if (options.fork_mode)
+    {
+        options.threads = 1;
+        //idle parent connections opened in the parent would be shared by
+        //all children, each child connects to its parent when it needs one
+        options.parent_pool_size = 0;
+    }
+    //one loop per CPU given
+    else if (!threads_given && !options.cpus.empty())
+        options.threads = options.cpus.size();
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        if (!parse_options(argc, argv))
+        {
+            usage();
+            return 1;
+        }
+        //splice() to a peer that reset takes no MSG_NOSIGNAL, EPIPE must not
+        //kill the process; set before any loop thread starts
+        signal(SIGPIPE, SIG_IGN);
+        admission::limits limits;
+        limits.max_tunnels = options.max_tunnels;
+        limits.max_per_client = options.max_per_client;
+        limits.max_connect_rate = options.max_connect_rate;
+        limits.client_bandwidth = options.client_bandwidth;
+        admission_.configure(limits);
+        load_firewall();
+        if (!access_log.open(options.access_log_path,
+                             options.access_log_jsonl ? access_logger::format_jsonl : access_logger::format_text,
+                             !options.fork_mode))
+        {
+            std::cerr << "cannot open access log " << options.access_log_path << "\n";
+            return 1;
+        }
+        if (!options.top_path.empty() && !top_tunnels.open(options.top_path))
+        {
+            std::cerr << "cannot export tunnels to " << options.top_path << "\n";
+            return 1;
+        }
+
+        std::vector<int> listeners;
+        int metrics_listener = -1;
+        int handoff = -1;
+        if (!options.handoff_path.empty())
+            handoff = hot_restart::take_over(options.handoff_path, listeners, metrics_listener);
+
+        std::vector<std::unique_ptr<server>> servers;
+        for (unsigned i = 0; i < options.threads; i++)
+        {
+            //allocated from its CPU, so first touch puts the loop's memory,
+            //e.g. the ring's buffers, on its NUMA node
+            cpu_placement::pin(cpu_placement::cpu_of(i));
+            loops.emplace_back(new event_loop);
+            auto &loop = *loops.back();
+            //a forked child would share its parent's rings
+            if (options.io_uring && !options.fork_mode)
+            {
+                boost::system::error_code ec;
+                loop.ring.reset(new uring(loop.io_context));
+                loop.ring->open(options.uring_buffers, ec);
+                if (ec)
+                {
+                    std::cerr << "io_uring unavailable (" << ec.message() << "), using epoll\n";
+                    loop.ring.reset();
+                    options.io_uring = false;
+                }
+            }
+        }
+        //a forked child would accept on its parent's BIND ports
+        if (options.bind_port_low && !options.fork_mode)
+        {
+            unsigned opened = 0, total = options.bind_port_high - options.bind_port_low + 1;
+            boost::system::error_code ec, last;
+            for (unsigned port = options.bind_port_low; port <= options.bind_port_high; port++)
+            {
+                loops[port % options.threads]->binds.open(port, ec);
+                if (ec)
+                    last = ec;
+                else
+                    opened++;
+            }
+            if (opened < total)
+                std::cerr << "BIND ports: listening on " << opened << " of " << total << " (" << last.message() << ")\n";
+        }
+        std::unique_ptr<metrics_server> stats;
+        if (options.metrics_port)
+            stats.reset(new metrics_server(loops[0]->io_context, options.metrics_port, metrics_listener));
+        else if (metrics_listener >= 0)
+            ::close(metrics_listener);
+        //every listener taken over keeps being served, more threads than
+        //listeners add their own to the same SO_REUSEPORT group
+        for (std::size_t i = 0; i < std::max<std::size_t>(options.threads, listeners.size()); i++)
+        {
+            auto &loop = *loops[i % options.threads];
+            servers.emplace_back(new server(loop.io_context, options.port, loop.ring.get(), stats.get(),
+                                            i < listeners.size() ? listeners[i] : -1));
+        }
+        if (!options.cpus.empty() && !options.fork_mode)
+        {
+            std::vector<int> fds, cpus;
+            for (std::size_t i = 0; i < servers.size(); i++)
+            {
+                fds.push_back(servers[i]->native_handle());
+                cpus.push_back(cpu_placement::cpu_of(i % options.threads));
+            }
+            boost::system::error_code ec;
+            cpu_placement::steer(fds, cpus, ec);
+            if (ec)
+                std::cerr << "accepting regardless of the incoming CPU (" << ec.message() << ")\n";
+        }
+        std::unique_ptr<hot_restart> restart;
+        if (handoff >= 0)
+        {
+            hot_restart::acknowledge(handoff);
+            std::cerr << "took over " << listeners.size() << " listeners\n";
+        }
+        if (!options.handoff_path.empty())
+            restart.reset(new hot_restart(loops[0]->io_context, options.handoff_path, servers, stats.get()));
+
+        boost::asio::signal_set signals(loops[0]->io_context, SIGHUP, SIGUSR1);
+        signals.add(SIGINT);
+        signals.add(SIGTERM);
+        //fork mode reaps its children here, admission slots are held until then
+        if (options.fork_mode)
+            signals.add(SIGCHLD);
+        std::function<void()> wait_signal = [&] {
+            signals.async_wait([&](boost::system::error_code ec, int signo) {
+                if (ec)
+                    return;
+                if (signo == SIGINT || signo == SIGTERM)
+                {
+                    //leave run() so the access log is flushed on the way out
+                    for (auto &loop : loops)
+                        loop->io_context.stop();
+                    return;
+                }
+                if (signo == SIGHUP)
+                {
+                    load_firewall();
+                    auto rules = std::atomic_load(&firewall_);
+                    for (auto &loop : loops)
+                    {
+                        auto *l = loop.get();
+                        boost::asio::post(l->io_context, [l, rules] { l->parents.configure(*rules); });
+                    }
+                }
+                else if (signo == SIGCHLD)
+                    servers[0]->reap_children();
+                else
+                    print_stats();
+                wait_signal();
+            });
+        };
+        wait_signal();
+
+        for (auto &loop : loops)
+        {
+            loop->prewarm.start();
+            loop->parents.configure(*std::atomic_load(&firewall_));
+        }
+        std::vector<std::thread> threads;
+        for (unsigned i = 1; i < loops.size(); i++)
+            threads.emplace_back([i] {
+                cpu_placement::pin(cpu_placement::cpu_of(i));
+                this_loop = loops[i].get();
+                loops[i]->io_context.run();
+            });
+        cpu_placement::pin(cpu_placement::cpu_of(0));
+        this_loop = loops[0].get();
+        loops[0]->io_context.run();
+        for (auto &t : threads)
+            t.join();
+        top_tunnels.close();
+        access_log.close();
     }
     catch (std::exception &e)
     {
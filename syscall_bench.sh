@@ -0,0 +1,26 @@
+#!/bin/sh
+#syscalls of the server during one socks_bench run, counted by the
+#syscall_count.so preload shim (make syscall_count.so)
+#
+#usage: ./syscall_bench.sh [socks_bench options]
+#   e.g. ./syscall_bench.sh --bulk 1024
+#        ./syscall_bench.sh -c 100 -n 20000 -p 16384
+#SERVER_ARGS (default "-t 1") is passed to the server, e.g. "-t 1 --io-uring"
+
+[ $# -eq 0 ] && set -- --bulk 1024
+port=${PORT:-1094}
+server_args=${SERVER_ARGS:--t 1}
+counts=$(mktemp)
+
+[ -f syscall_count.so ] || make syscall_count.so >/dev/null || exit 1
+
+SYSCALL_COUNT_OUT=$counts LD_PRELOAD=./syscall_count.so ./socks_server $server_args -l off "$port" &
+pid=$!
+sleep 0.5
+./socks_bench -s 127.0.0.1:"$port" "$@"
+status=$?
+kill "$pid"
+wait "$pid" 2>/dev/null
+echo "server:    $(cat "$counts")"
+rm -f "$counts"
+exit "$status"
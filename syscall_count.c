@@ -0,0 +1,131 @@
+//LD_PRELOAD shim counting the syscalls of the relay path, for hosts without
+//strace or perf. the counts go to $SYSCALL_COUNT_OUT (default stderr) when
+//the process exits; socks_server exits normally on SIGINT or SIGTERM.
+//
+//    make syscall_count.so
+//    SYSCALL_COUNT_OUT=counts LD_PRELOAD=./syscall_count.so ./socks_server 1080
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+static atomic_long recvs, sends, epoll_waits, uring_enters, reads, writes, accepts, splices, others;
+
+#define REAL(name)                                  \
+    static __typeof__(name) *real;                  \
+    if (!real)                                      \
+        real = (__typeof__(name) *)dlsym(RTLD_NEXT, #name)
+
+ssize_t recvmsg(int fd, struct msghdr *msg, int flags)
+{
+    REAL(recvmsg);
+    recvs++;
+    return real(fd, msg, flags);
+}
+
+ssize_t recv(int fd, void *buf, size_t n, int flags)
+{
+    REAL(recv);
+    recvs++;
+    return real(fd, buf, n, flags);
+}
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+    REAL(sendmsg);
+    sends++;
+    return real(fd, msg, flags);
+}
+
+ssize_t send(int fd, const void *buf, size_t n, int flags)
+{
+    REAL(send);
+    sends++;
+    return real(fd, buf, n, flags);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int max, int timeout)
+{
+    REAL(epoll_wait);
+    epoll_waits++;
+    return real(epfd, events, max, timeout);
+}
+
+ssize_t read(int fd, void *buf, size_t n)
+{
+    REAL(read);
+    reads++;
+    return real(fd, buf, n);
+}
+
+ssize_t write(int fd, const void *buf, size_t n)
+{
+    REAL(write);
+    writes++;
+    return real(fd, buf, n);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int n)
+{
+    REAL(writev);
+    writes++;
+    return real(fd, iov, n);
+}
+
+int accept(int fd, struct sockaddr *addr, socklen_t *len)
+{
+    REAL(accept);
+    accepts++;
+    return real(fd, addr, len);
+}
+
+int accept4(int fd, struct sockaddr *addr, socklen_t *len, int flags)
+{
+    REAL(accept4);
+    accepts++;
+    return real(fd, addr, len, flags);
+}
+
+ssize_t splice(int in, loff_t *in_off, int out, loff_t *out_off, size_t n, unsigned flags)
+{
+    REAL(splice);
+    splices++;
+    return real(in, in_off, out, out_off, n, flags);
+}
+
+//io_uring is driven through syscall(), there is no libc wrapper
+long syscall(long number, ...)
+{
+    REAL(syscall);
+    va_list ap;
+    long a[6];
+    va_start(ap, number);
+    for (int i = 0; i < 6; i++)
+        a[i] = va_arg(ap, long);
+    va_end(ap);
+    if (number == __NR_io_uring_enter)
+        uring_enters++;
+    else
+        others++;
+    return real(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+__attribute__((destructor)) static void report(void)
+{
+    const char *path = getenv("SYSCALL_COUNT_OUT");
+    FILE *out = path ? fopen(path, "w") : stderr;
+    if (!out)
+        return;
+    fprintf(out, "recv %ld, send %ld, epoll_wait %ld, io_uring_enter %ld, read %ld, write %ld, accept %ld, splice %ld, other syscall() %ld\n",
+            recvs, sends, epoll_waits, uring_enters, reads, writes, accepts, splices, others);
+    if (path)
+        fclose(out);
+}
@@ -0,0 +1,221 @@
+#ifndef TIMING_WHEEL_HPP
+#define TIMING_WHEEL_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <boost/asio.hpp>
+
+//event loop timers. shared by socks_server and the timer benchmark of
+//socks_bench.
+
+//hierarchical timing wheel of one event loop: three levels of 256 slots at
+//100 ms resolution, spanning ~19 days. timers are intrusive list nodes
+//embedded in their owners, so arming and cancelling allocate nothing and
+//cost O(1); moving a deadline later, as an idle timeout does on every
+//relayed chunk, only stores the new tick and the timer is moved when its
+//old slot comes up. one steady_timer drives the wheel while timers are armed.
+class timing_wheel
+{
+    struct node
+    {
+        node *prev = this;
+        node *next = this;
+    };
+
+public:
+    typedef uint64_t tick_type;
+    static constexpr std::chrono::milliseconds resolution{100};
+
+    class timer : private node
+    {
+    public:
+        explicit timer(std::function<void()> expired) : expired_(std::move(expired)) {}
+        timer(const timer &) = delete;
+        timer &operator=(const timer &) = delete;
+        ~timer()
+        {
+            cancel();
+        }
+
+        void expires_after(timing_wheel &wheel, std::chrono::steady_clock::duration d)
+        {
+            wheel.arm(*this, d);
+        }
+        void cancel()
+        {
+            if (wheel_)
+                wheel_->unlink(*this);
+        }
+        bool armed() const
+        {
+            return wheel_ != nullptr;
+        }
+
+    private:
+        friend class timing_wheel;
+        timing_wheel *wheel_ = nullptr;
+        tick_type deadline_ = 0;
+        //the tick the timer's slot was chosen for, never after deadline_
+        tick_type placed_ = 0;
+        std::function<void()> expired_;
+    };
+
+    timing_wheel(boost::asio::io_context &io_context) : ticker_(io_context), origin_(std::chrono::steady_clock::now()) {}
+    //owners still holding timers, such as handlers the io_context destroys
+    //after the wheel, find them disarmed
+    ~timing_wheel()
+    {
+        for (auto &level : wheel_)
+            for (auto &slot : level)
+                while (slot.next != &slot)
+                {
+                    timer &t = static_cast<timer &>(*slot.next);
+                    detach(t);
+                    t.wheel_ = nullptr;
+                }
+    }
+    std::size_t size() const
+    {
+        return count_;
+    }
+
+private:
+    enum
+    {
+        levels = 3,
+        slot_bits = 8,
+        slots = 1 << slot_bits,
+        slot_mask = slots - 1
+    };
+    static constexpr tick_type max_span = (tick_type(1) << (levels * slot_bits)) - 1;
+
+    node wheel_[levels][slots];
+    tick_type now_ = 0;
+    std::size_t count_ = 0;
+    boost::asio::steady_timer ticker_;
+    std::chrono::steady_clock::time_point origin_;
+
+    tick_type real_tick() const
+    {
+        return (std::chrono::steady_clock::now() - origin_) / resolution;
+    }
+
+    void arm(timer &t, std::chrono::steady_clock::duration d)
+    {
+        auto elapsed = std::chrono::steady_clock::now() - origin_;
+        if (count_ == 0)
+            now_ = elapsed / resolution;
+        //from the clock, not now_ which lags it until the next tick; rounded
+        //up, so a timer never fires early
+        tick_type deadline = std::max<tick_type>(now_ + 1, (elapsed + d + resolution - std::chrono::nanoseconds(1)) / resolution);
+        if (t.wheel_ == this && deadline >= t.placed_)
+        {
+            t.deadline_ = deadline;
+            return;
+        }
+        t.cancel();
+        t.wheel_ = this;
+        t.deadline_ = deadline;
+        if (count_++ == 0)
+            schedule_tick();
+        insert(t);
+    }
+
+    void insert(timer &t)
+    {
+        t.placed_ = std::min(t.deadline_, now_ + max_span);
+        tick_type delta = t.placed_ - now_;
+        int level = 0;
+        while (level < levels - 1 && delta >= tick_type(1) << ((level + 1) * slot_bits))
+            level++;
+        link(wheel_[level][(t.placed_ >> (level * slot_bits)) & slot_mask], t);
+    }
+
+    static void link(node &head, node &n)
+    {
+        n.prev = head.prev;
+        n.next = &head;
+        head.prev->next = &n;
+        head.prev = &n;
+    }
+    static void detach(node &n)
+    {
+        n.prev->next = n.next;
+        n.next->prev = n.prev;
+        n.prev = n.next = &n;
+    }
+    void unlink(timer &t)
+    {
+        detach(t);
+        t.wheel_ = nullptr;
+        count_--;
+    }
+
+    //moves a whole slot onto a local list first, so callbacks may arm and
+    //cancel any timer, including the ones still waiting on that list
+    static void take(node &slot, node &out)
+    {
+        if (slot.next == &slot)
+            return;
+        out.next = slot.next;
+        out.prev = slot.prev;
+        out.next->prev = &out;
+        out.prev->next = &out;
+        slot.prev = slot.next = &slot;
+    }
+
+    void cascade(int level)
+    {
+        node pending;
+        take(wheel_[level][(now_ >> (level * slot_bits)) & slot_mask], pending);
+        while (pending.next != &pending)
+        {
+            timer &t = static_cast<timer &>(*pending.next);
+            detach(t);
+            insert(t);
+        }
+    }
+
+    void advance()
+    {
+        now_++;
+        //higher levels first, their timers may land in a lower level slot due now
+        for (int level = levels - 1; level > 0; level--)
+            if ((now_ & ((tick_type(1) << (level * slot_bits)) - 1)) == 0)
+                cascade(level);
+        node due;
+        take(wheel_[0][now_ & slot_mask], due);
+        while (due.next != &due)
+        {
+            timer &t = static_cast<timer &>(*due.next);
+            detach(t);
+            if (t.deadline_ > now_)
+            {
+                insert(t);
+                continue;
+            }
+            t.wheel_ = nullptr;
+            count_--;
+            t.expired_();
+        }
+    }
+
+    void schedule_tick()
+    {
+        ticker_.expires_at(origin_ + resolution * int64_t(now_ + 1));
+        ticker_.async_wait([this](boost::system::error_code ec) {
+            if (ec)
+                return;
+            for (tick_type target = real_tick(); now_ < target && count_;)
+                advance();
+            if (count_)
+                schedule_tick();
+        });
+    }
+};
+constexpr std::chrono::milliseconds timing_wheel::resolution;
+constexpr timing_wheel::tick_type timing_wheel::max_span;
+
+#endif
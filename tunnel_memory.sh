@@ -0,0 +1,47 @@
+#!/bin/sh
+#user space memory of idle tunnels: socks_bench opens TUNNELS CONNECT tunnels
+#at once and holds them open without traffic; the server's RSS growth over
+#its idle RSS, divided by TUNNELS, is the cost of one tunnel. every tunnel
+#takes two descriptors in the server and two in socks_bench, so TUNNELS is
+#bounded by the fd limit.
+#
+#usage: ./tunnel_memory.sh [TUNNELS]
+#SERVER_ARGS (default "-t 1") is passed to the server
+
+n=${1:-4000}
+port=${PORT:-1095}
+metrics=${METRICS_PORT:-9195}
+server_args=${SERVER_ARGS:--t 1}
+hold=20
+
+rss_kb()
+{
+    awk '$1 == "VmRSS:" { print $2 }' /proc/"$pid"/status
+}
+
+active()
+{
+    curl -s "http://127.0.0.1:$metrics/" | awk '$1 == "socks_active_tunnels" { print $2 }'
+}
+
+./socks_server $server_args -l off -m "$metrics" "$port" &
+pid=$!
+sleep 0.5
+idle=$(rss_kb)
+
+./socks_bench -s 127.0.0.1:"$port" -c "$n" -n "$n" --hold "$hold" >/dev/null &
+bench=$!
+waited=0
+while [ "$(active)" != "$n" ] && [ "$waited" -lt "$hold" ]; do
+    sleep 1
+    waited=$((waited + 1))
+done
+open=$(active)
+held=$(rss_kb)
+kill "$bench"
+kill "$pid"
+wait "$pid" 2>/dev/null
+
+echo "idle server:  $idle KB RSS"
+echo "$open tunnels: $held KB RSS, $(echo "$idle $held $open" | awk '{ printf "%.2f", ($2 - $1) / $3 }') KB per tunnel"
+[ "$open" = "$n" ]